@@ -1,5 +1,86 @@
 #include "myFunction.h"
 
+// The SSE4.2, SHA-NI and AVX2 kernels are x86 only; every other target uses the portable
+// code next to them
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+__thread FILE *shellIn;
+__thread FILE *shellOut;
+
+void initOutput()
+{
+    // Fully buffered whether or not stdout is a terminal; the shell flushes explicitly
+    setvbuf(stdout, NULL, _IOFBF, OUT_BUFF);
+}
+
+void flushOutput()
+{
+    if (shellOut != NULL && shellOut != stdout)
+        fflush(shellOut);
+    fflush(stdout);
+}
+
+void writeOutputv(const struct iovec *iov, int count)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+
+    // Small writes are cheaper to gather in the stdio buffer, and memory streams have no fd
+    if (total < OUT_BUFF / 4 || count > IOV_MAX || fileno(shellOut) < 0)
+    {
+        for (int i = 0; i < count; i++)
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, shellOut);
+        return;
+    }
+
+    // Large ones go out with a single writev after whatever is already pending
+    fflush(shellOut);
+    struct iovec pending[count];
+    memcpy(pending, iov, count * sizeof(struct iovec));
+    struct iovec *next = pending;
+    while (count > 0)
+    {
+        ssize_t written = writev(fileno(shellOut), next, count);
+        if (written < 0)
+            return; // EPIPE when the reader went away, nothing left to do
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+}
+
+void writeOutput(const char *data, size_t len)
+{
+    struct iovec iov = {(void *)data, len};
+    writeOutputv(&iov, 1);
+}
+
+// Copies a stream to the shell output in large blocks
+// @return The number of bytes copied.
+static size_t streamToOutput(FILE *file)
+{
+    char buffer[OUT_BUFF];
+    size_t n, total = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        writeOutput(buffer, n);
+        total += n;
+    }
+    return total;
+}
+
 char *my_strtok(char *str, const char *delim)
 {
     static char *lastToken = NULL; // Maintain the context of string between successive calls
@@ -65,16 +146,134 @@ void getLocation()
 
     // Print the separator, cwd, and '$' sign in a different color, for example blue (\033[0;34m)
     printf("\033[0;34m:%s$\033[0m ", cwd);
-    fflush(stdout); // Ensure that the output is displayed before reading input
+    flushOutput(); // Ensure that the output is displayed before reading input
+}
+
+static void appendInput(char **line, size_t *len, size_t *size, const char *text, size_t n)
+{
+    while (*len + n + 1 > *size)
+    {
+        *size *= 2;
+        *line = realloc(*line, *size);
+    }
+    memcpy(*line + *len, text, n);
+    *len += n;
+}
+
+// Line editor for terminals: echoes input itself so that Tab can complete in place.
+// Backspace, Ctrl-U (erase line), Ctrl-C (discard line) and Ctrl-D (exit on an empty
+// line) are handled; arrow keys and other escape sequences are ignored.
+static char *readTerminalLine(void)
+{
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) != 0)
+        return NULL;
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    size_t len = 0, size = 128;
+    char *line = malloc(size);
+    int tabs = 0;
+    while (1)
+    {
+        unsigned char ch;
+        if (read(STDIN_FILENO, &ch, 1) != 1 || (ch == 4 && len == 0))
+        {
+            fputs(len == 0 ? "exit\n" : "\n", stdout);
+            if (len == 0)
+            {
+                appendInput(&line, &len, &size, "exit", 4);
+                inputEnded = 1;
+            }
+            break;
+        }
+        tabs = ch == '\t' ? tabs + 1 : 0;
+        if (ch == '\n' || ch == '\r')
+        {
+            fputc('\n', stdout);
+            break;
+        }
+        else if (ch == '\t')
+        {
+            char extension[PATH_MAX];
+            line[len] = '\0';
+            int matches = completeLine(line, len, extension, sizeof(extension), NULL);
+            if (extension[0] != '\0')
+            {
+                appendInput(&line, &len, &size, extension, strlen(extension));
+                fputs(extension, stdout);
+                tabs = matches > 1; // Still ambiguous: the next Tab lists
+                if (matches > 1)
+                    fputc('\a', stdout);
+            }
+            else if (matches > 1 && tabs > 1)
+            {
+                // A second Tab lists the candidates and redraws the line below them
+                fputc('\n', stdout);
+                completeLine(line, len, extension, sizeof(extension), stdout);
+                getLocation();
+                fwrite(line, 1, len, stdout);
+            }
+            else
+                fputc('\a', stdout);
+        }
+        else if (ch == 127 || ch == '\b')
+        {
+            if (len == 0)
+                continue;
+            while (len > 1 && (line[len - 1] & 0xC0) == 0x80) // Whole UTF-8 characters
+                len--;
+            len--;
+            fputs("\b \b", stdout);
+        }
+        else if (ch == 21)
+        {
+            for (; len > 0; len--)
+                if ((line[len - 1] & 0xC0) != 0x80)
+                    fputs("\b \b", stdout);
+        }
+        else if (ch == 3)
+        {
+            fputs("^C\n", stdout);
+            len = 0;
+            getLocation();
+        }
+        else if (ch == 27)
+        {
+            // Skip "ESC [ params final" and two byte escapes
+            if (read(STDIN_FILENO, &ch, 1) == 1 && (ch == '[' || ch == 'O'))
+                while (read(STDIN_FILENO, &ch, 1) == 1 && !(ch >= 0x40 && ch <= 0x7E))
+                    ;
+        }
+        else if (ch >= 32 || ch >= 0x80)
+        {
+            appendInput(&line, &len, &size, (char *)&ch, 1);
+            fputc(ch, stdout);
+        }
+        fflush(stdout);
+    }
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    line[len] = '\0';
+    return line;
 }
 
+int inputEnded; // Set once getInputFromUser has reached the end of its input
+
 char *getInputFromUser()
 {
-    char ch;
+    char *line = isatty(STDIN_FILENO) ? readTerminalLine() : NULL;
+    if (line != NULL)
+        return line;
+
+    int ch;
     int size = 1;
     int index = 0;
     char *str = (char *)malloc(size * sizeof(char));
-    while ((ch = getchar()) != '\n')
+    while ((ch = getchar()) != '\n' && ch != EOF)
     {
         *(str + index) = ch;
         size++;
@@ -82,9 +281,42 @@ char *getInputFromUser()
         str = (char *)realloc(str, size);
     }
     *(str + index) = '\0';
+    if (ch == EOF && index == 0)
+    {
+        // End of input behaves like "exit" instead of returning empty lines forever
+        free(str);
+        inputEnded = 1;
+        return strdup("exit");
+    }
     return str;
 }
 
+// Finds the ')' or '`' that closes the command substitution starting at 'start'. Nested
+// substitutions and double quoted text are skipped; NULL when it is never closed.
+static const char *substitutionEnd(const char *start)
+{
+    if (*start == '`')
+        return strchr(start + 1, '`');
+    int depth = 1, inQuotes = 0;
+    for (const char *c = start + 2; *c; c++)
+    {
+        if ((*c == '$' && c[1] == '(') || *c == '`')
+        {
+            if ((c = substitutionEnd(c)) == NULL)
+                return NULL;
+        }
+        else if (*c == '\"')
+            inQuotes = !inQuotes;
+        else if (inQuotes)
+            continue;
+        else if (*c == '(')
+            depth++;
+        else if (*c == ')' && --depth == 0)
+            return c;
+    }
+    return NULL;
+}
+
 char **splitArgument(char *str)
 {
     int size = 1, index = 0;
@@ -95,7 +327,13 @@ char **splitArgument(char *str)
 
     while (*end)
     {
-        if (*end == '\"')
+        if ((*end == '$' && end[1] == '(') || *end == '`')
+        {
+            // A command substitution stays in one argument, quotes and spaces included
+            const char *close = substitutionEnd(end);
+            end = close ? (char *)close : end + strlen(end) - 1;
+        }
+        else if (*end == '\"')
         {
             inQuotes = !inQuotes;
         }
@@ -151,33 +389,57 @@ void logout(char *input)
 void echo(char **arguments)
 {
 
-    while (*(++arguments))
-        printf("%s ", *arguments);
+    int count = 0;
+    while (arguments[count + 1] != NULL)
+        count++;
 
-    puts("");
+    // Gather every argument and separator into one write
+    struct iovec iov[2 * count + 1];
+    for (int i = 0; i < count; i++)
+    {
+        iov[2 * i].iov_base = arguments[i + 1];
+        iov[2 * i].iov_len = strlen(arguments[i + 1]);
+        iov[2 * i + 1].iov_base = " ";
+        iov[2 * i + 1].iov_len = 1;
+    }
+    iov[2 * count].iov_base = "\n";
+    iov[2 * count].iov_len = 1;
+    writeOutputv(iov, 2 * count + 1);
 }
 
 void cp(char **arguments)
 {
-    char ch;
-    FILE *src, *des;
-    if ((src = fopen(arguments[1], "r")) == NULL)
+    if (arguments[1] != NULL && strcmp(arguments[1], "--verify") == 0)
     {
-        puts("error");
+        // cp --verify source destination
+        uint32_t checksum;
+        if (arguments[2] == NULL || arguments[3] == NULL || copyVerified(arguments[2], arguments[3], &checksum) != 0)
+        {
+            puts("error");
+            lastStatus = 1;
+        }
+        else
+            fprintf(shellOut, "verified %s crc32c %08x\n", arguments[3], checksum);
         return;
     }
-
-    if ((des = fopen(arguments[2], "w")) == NULL)
+    if (arguments[1] == NULL || arguments[2] == NULL)
     {
         puts("error");
-        fclose(src);
+        lastStatus = 1;
+        return;
+    }
+    if (arguments[3] != NULL)
+    {
+        // Several sources: copy them all into the directory named last
+        copyIntoDirectory(arguments);
         return;
     }
-    while ((ch = fgetc(src)) != EOF)
-        fputc(ch, des);
 
-    fclose(src);
-    fclose(des);
+    if (copyFile(arguments[1], arguments[2]) != 0)
+    {
+        puts("error");
+        lastStatus = 1;
+    }
 }
 
 void cd(char **path)
@@ -206,7 +468,10 @@ void cd(char **path)
     }
 
     if (chdir(combenedPath) != 0)
+    {
         printf("-myShell: cd: %s: No suche file or direction\n", path[1]);
+        lastStatus = 1;
+    }
 }
 
 void delete(char **path)
@@ -215,6 +480,7 @@ void delete(char **path)
     if (path[1] == NULL)
     {
         printf("-myShell: delete: Missing file name\n");
+        lastStatus = 1;
         return;
     }
 
@@ -223,6 +489,7 @@ void delete(char **path)
     {
         perror("-myShell: delete");
         printf("-myShell: delete: %s: No such file or directory\n", path[1]);
+        lastStatus = 1;
     }
     else
     {
@@ -230,36 +497,528 @@ void delete(char **path)
         {
             perror("-myShell: delete");
             printf("-myShell: delete: %s: No such file or directory\n", resolved_path);
+            lastStatus = 1;
         }
 
         free(resolved_path);
     }
 }
 
-void mypipe(char **argv1, char **argv2)
+static int pipePinAuto; // "set pipepin auto": place pipeline stages on cores sharing a cache
+static int pipeSize;    // "set pipesize": capacity given to pipeline pipes, 0 keeps the default
+
+// pipe(2) for a pipeline, resized to the configured capacity
+static int openPipe(int fildes[2])
+{
+    if (pipe(fildes) != 0)
+        return -1;
+    if (pipeSize > 0 && fcntl(fildes[1], F_SETPIPE_SZ, pipeSize) < 0)
+        perror("-myShell: F_SETPIPE_SZ"); // Above /proc/sys/fs/pipe-max-size without privileges
+    return 0;
+}
+
+int parseCpuList(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0)
+            return -1;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Strips the leading @cpu=LIST, @nice=N and @batch words off a command. A word that
+// cannot be parsed fails the command, as taskset does: NULL is returned.
+static char **takePlacement(char **argv, StagePlacement *placement)
+{
+    memset(placement, 0, sizeof(*placement));
+    for (; argv[0] != NULL && argv[0][0] == '@'; argv++)
+    {
+        if (strncmp(argv[0], "@cpu=", 5) == 0 && parseCpuList(argv[0] + 5, &placement->cpus) == 0)
+            placement->hasCpus = 1;
+        else if (strncmp(argv[0], "@nice=", 6) == 0)
+        {
+            placement->hasNice = 1;
+            placement->nice = atoi(argv[0] + 6);
+        }
+        else if (strcmp(argv[0], "@batch") == 0)
+            placement->batch = 1;
+        else
+        {
+            printf("-myShell: %s: invalid placement, expected @cpu=LIST, @nice=N or @batch\n", argv[0]);
+            lastStatus = 1;
+            return NULL;
+        }
+    }
+    return argv;
+}
+
+static int placementActive(const StagePlacement *placement)
+{
+    return placement != NULL && (placement->hasCpus || placement->hasNice || placement->batch);
+}
+
+// Applies a placement to the calling thread (in a forked child, to the whole process)
+// Applies a placement to the calling thread; the command must not run when it fails
+// @return 0 on success, -1 after printing the error.
+static int applyPlacement(const StagePlacement *placement)
+{
+    if (!placementActive(placement))
+        return 0;
+    if (placement->hasCpus && sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) != 0)
+    {
+        perror("-myShell: sched_setaffinity");
+        return -1;
+    }
+    if (placement->hasNice && setpriority(PRIO_PROCESS, gettid(), placement->nice) != 0)
+    {
+        perror("-myShell: setpriority");
+        return -1;
+    }
+    struct sched_param param = {0};
+    if (placement->batch && sched_setscheduler(0, SCHED_BATCH, &param) != 0)
+    {
+        perror("-myShell: sched_setscheduler");
+        return -1;
+    }
+    return 0;
+}
+
+// Finds the CPUs sharing the closest level 2 or higher cache with 'cpu'
+static int cacheSiblings(int cpu, cpu_set_t *siblings)
 {
+    for (int index = 0; index < 8; index++)
+    {
+        char path[128], text[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+            break;
+        int level = fscanf(file, "%d", &level) == 1 ? level : 0;
+        fclose(file);
+        if (level < 2)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        int ok = fgets(text, sizeof(text), file) != NULL && parseCpuList(text, siblings) == 0;
+        fclose(file);
+        if (ok && CPU_COUNT(siblings) >= 2)
+            return 0;
+    }
+    return -1;
+}
+
+// Gives two neighbouring stages distinct CPUs that share a cache, unless placed explicitly
+static void autoPlace(StagePlacement *producer, StagePlacement *consumer)
+{
+    cpu_set_t allowed, siblings;
+    int cpu = sched_getcpu();
+    if (cpu < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || cacheSiblings(cpu, &siblings) != 0)
+        return;
+    CPU_AND(&siblings, &siblings, &allowed);
+
+    int chosen[2] = {-1, -1}, found = 0;
+    if (CPU_ISSET(cpu, &siblings))
+        chosen[found++] = cpu;
+    for (int other = 0; other < CPU_SETSIZE && found < 2; other++)
+        if (other != cpu && CPU_ISSET(other, &siblings))
+            chosen[found++] = other;
+    if (found == 0)
+        return;
+    if (found == 1)
+        chosen[1] = chosen[0];
+
+    StagePlacement *stages[2] = {producer, consumer};
+    for (int i = 0; i < 2; i++)
+    {
+        if (stages[i]->hasCpus)
+            continue;
+        CPU_ZERO(&stages[i]->cpus);
+        CPU_SET(chosen[i], &stages[i]->cpus);
+        stages[i]->hasCpus = 1;
+    }
+}
+
+typedef struct
+{
+    BuiltinFunc func;
+    char **args;
+    FILE *in;    // Stream the stage reads from
+    FILE *out;   // Stream the stage writes to
+    int ownsOut; // Close 'out' when the stage ends, signalling end of file to the reader
+    const StagePlacement *placement;
+} PipeStage;
+
+static void *runPipeStage(void *arg)
+{
+    PipeStage *stage = arg;
+    shellIn = stage->in;
+    shellOut = stage->out;
+    if (applyPlacement(stage->placement) == 0)
+        stage->func(stage->args);
+    else
+        lastStatus = 1;
+    if (stage->ownsOut)
+        fclose(stage->out);
+    return NULL;
+}
+
+// Wraps one end of the pipe in a stream; on failure the descriptor is closed, so the
+// stage at the other end sees end of file or EPIPE rather than waiting forever
+static FILE *openPipeStream(int fd, const char *mode)
+{
+    FILE *stream = fdopen(fd, mode);
+    if (stream == NULL)
+    {
+        perror("-myShell: pipe");
+        close(fd);
+        lastStatus = 1;
+    }
+    else if (*mode == 'w')
+        setvbuf(stream, NULL, _IOFBF, OUT_BUFF);
+    return stream;
+}
+
+// Runs a builtin stage to completion from the calling thread. A placed stage gets a
+// thread of its own, so that the shell's thread keeps its affinity and priority.
+static void runStageHere(PipeStage *stage)
+{
+    FILE *savedIn = shellIn, *savedOut = shellOut;
+    pthread_t thread;
+    if (placementActive(stage->placement) && pthread_create(&thread, NULL, runPipeStage, stage) == 0)
+        pthread_join(thread, NULL);
+    else
+    {
+        PipeStage unplaced = *stage;
+        unplaced.placement = NULL;
+        runPipeStage(&unplaced);
+    }
+    shellIn = savedIn;
+    shellOut = savedOut;
+}
+
+// Executes 'file', handing it to /bin/sh when it is a script without a #! line
+static void execFile(const char *file, char **argv, char **envp)
+{
+    execve(file, argv, envp);
+    if (errno != ENOEXEC)
+        return;
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    char *script[argc + 2];
+    script[0] = "/bin/sh";
+    script[1] = (char *)file;
+    memcpy(script + 2, argv + 1, argc * sizeof(char *));
+    execve(script[0], script, envp);
+}
+
+// Runs 'argv' like execvpe, but searches the PATH of 'envp' (which holds per-command
+// assignments), or else the shell's PATH variable, rather than the process's own.
+// Only looks things up and builds paths on the stack, so it is safe after fork.
+static void execSearch(char **argv, char **envp)
+{
+    const char *path = NULL;
+    for (char **entry = envp; *entry != NULL && path == NULL; entry++)
+        if (strncmp(*entry, "PATH=", 5) == 0)
+            path = *entry + 5;
+    if (path == NULL)
+        path = getVariable("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+
+    int denied = 0;
+    size_t nameLen = strlen(argv[0]);
+    for (const char *dir = path; strchr(argv[0], '/') == NULL; dir++)
+    {
+        const char *end = strchrnul(dir, ':');
+        size_t dirLen = end - dir;
+        char full[dirLen + nameLen + 2];
+        memcpy(full, dir, dirLen);
+        full[dirLen] = '/';
+        memcpy(full + dirLen + (dirLen > 0), argv[0], nameLen + 1); // An empty entry is "."
+        execFile(full, argv, envp);
+        denied |= errno == EACCES;
+        if (*end == '\0')
+        {
+            errno = denied ? EACCES : ENOENT;
+            return;
+        }
+        dir = end;
+    }
+    execFile(argv[0], argv, envp);
+}
+
+// Replaces the current process with 'argv', reading from 'in' and writing to 'out'.
+// 'envp' must be built before fork, see shellEnviron.
+static void execStage(char **argv, char **envp, const StagePlacement *placement, int in, int out)
+{
+    signal(SIGPIPE, SIG_DFL); // The shell itself ignores SIGPIPE, external commands should not
+    if (applyPlacement(placement) != 0)
+        _exit(1);
+    if (in != STDIN_FILENO)
+    {
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    if (out != STDOUT_FILENO)
+    {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    execSearch(argv, envp);
+    printf("-myShell: %s: command not found\n", argv[0]);
+    fflush(stdout); // _exit would drop it when stdout is a pipe
+    _exit(127);
+}
+
+static char **overrideEnviron(char **envp, char **assignments, int count);
+
+// Builtins see per-command assignments as exported variables while they run: each is
+// applied in turn, with the variable's old value and export flag kept in 'saved'
+static void applyAssignments(char **assignments, int count, char **saved, int *savedExported)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const char *name = assignments[i], *equals = strchr(name, '=');
+        char nameCopy[equals - name + 1];
+        memcpy(nameCopy, name, equals - name);
+        nameCopy[equals - name] = '\0';
+        const char *old = getVariable(nameCopy);
+        saved[i] = old ? strdup(old) : NULL;
+        savedExported[i] = isExported(nameCopy);
+        assignVariable(assignments[i], 1);
+    }
+}
+
+// Undoes applyAssignments, last assignment first
+static void restoreAssignments(char **assignments, int count, char **saved, int *savedExported)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        const char *equals = strchr(assignments[i], '=');
+        char nameCopy[equals - assignments[i] + 1];
+        memcpy(nameCopy, assignments[i], equals - assignments[i]);
+        nameCopy[equals - assignments[i]] = '\0';
+        if (saved[i] != NULL)
+        {
+            setVariable(nameCopy, saved[i], savedExported[i]);
+            free(saved[i]);
+        }
+        else
+            unsetVariable(nameCopy);
+    }
+}
 
+// Times fork plus exec as the parent sees it: every child inherits the write end of a
+// close-on-exec pipe, which reaches end of file once all of them have exec'd (or exited)
+typedef struct
+{
+    int ready[2];
+    int timed;
+    struct timespec started;
+} ForkTimer;
+
+static pid_t timedFork(ForkTimer *timer)
+{
+    timer->timed = pipe2(timer->ready, O_CLOEXEC) == 0;
+    clock_gettime(CLOCK_MONOTONIC, &timer->started);
+    pid_t pid = fork();
+    if (pid == 0 && timer->timed)
+        close(timer->ready[0]);
+    else if (pid < 0 && timer->timed)
+    {
+        close(timer->ready[0]);
+        close(timer->ready[1]);
+        timer->timed = 0;
+    }
+    return pid;
+}
+
+// Called by the parent after timedFork: waits for the exec and records it
+static void timedForkDone(ForkTimer *timer)
+{
+    if (!timer->timed)
+        return;
+    char byte;
+    struct timespec execd;
+    close(timer->ready[1]);
+    while (read(timer->ready[0], &byte, 1) < 0 && errno == EINTR)
+        ;
+    close(timer->ready[0]);
+    clock_gettime(CLOCK_MONOTONIC, &execd);
+    statsRecord(STAT_FORK_EXEC, (execd.tv_sec - timer->started.tv_sec) * 1000000 + (execd.tv_nsec - timer->started.tv_nsec) / 1000);
+}
+
+static void runPipe(BuiltinFunc first, char **argv1, char **envp1, const StagePlacement *place1,
+                    BuiltinFunc second, char **argv2, char **envp2, const StagePlacement *place2)
+{
     int fildes[2];
-    if (fork() == 0)
+    int out = fileno(shellOut) >= 0 ? fileno(shellOut) : STDOUT_FILENO; // Captured output has a pipe here
+    flushOutput(); // Children must not inherit pending output
+    ForkTimer timer;
+    if (first == NULL && second == NULL)
     {
-        pipe(fildes);
-        if (fork() == 0)
+        // Both stages inherit the timer, so one sample covers the whole pipeline
+        pid_t pid = timedFork(&timer);
+        if (pid == 0)
         {
-            /* first component of command line */
-            close(STDOUT_FILENO);
-            dup(fildes[1]);
+            openPipe(fildes);
+            if (fork() == 0)
+            {
+                /* first component of command line */
+                close(fildes[0]);
+                execStage(argv1, envp1, place1, STDIN_FILENO, fildes[1]);
+            }
+            /* 2nd command component of command line */
             close(fildes[1]);
-            close(fildes[0]);
-            execvp(argv1[0], argv1);
+            /* standard input now comes from pipe */
+            execStage(argv2, envp2, place2, fildes[0], out);
+        }
+        if (pid > 0)
+            timedForkDone(&timer);
+        return;
+    }
+
+    if (openPipe(fildes) != 0)
+    {
+        perror("-myShell: pipe");
+        return;
+    }
+
+    if (first != NULL && second != NULL)
+    {
+        // Both stages are builtins: the producer runs on a thread, the consumer here
+        FILE *reader = openPipeStream(fildes[0], "r");
+        FILE *writer = reader ? openPipeStream(fildes[1], "w") : NULL;
+        if (writer == NULL)
+        {
+            if (reader != NULL)
+                fclose(reader);
+            else
+                close(fildes[1]);
+            return;
+        }
+        PipeStage producer = {first, argv1, shellIn, writer, 1, place1};
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runPipeStage, &producer) != 0)
+        {
+            perror("-myShell: pipe");
+            fclose(writer);
+            fclose(reader);
+            return;
+        }
+        PipeStage consumer = {second, argv2, reader, shellOut, 0, place2};
+        runStageHere(&consumer);
+        fclose(consumer.in); // A producer still writing now gets EPIPE and finishes
+        pthread_join(thread, NULL);
+    }
+    else if (first != NULL)
+    {
+        // Builtin producer feeding an external command
+        pid_t pid = timedFork(&timer);
+        if (pid == 0)
+        {
+            close(fildes[1]);
+            execStage(argv2, envp2, place2, fildes[0], out);
         }
-        /* 2nd command component of command line */
-        close(STDIN_FILENO);
-        dup(fildes[0]);
+        if (pid > 0)
+            timedForkDone(&timer);
         close(fildes[0]);
+        PipeStage producer = {first, argv1, shellIn, openPipeStream(fildes[1], "w"), 1, place1};
+        if (producer.out != NULL)
+            runStageHere(&producer);
+    }
+    else
+    {
+        // External producer feeding a builtin
+        pid_t pid = timedFork(&timer);
+        if (pid == 0)
+        {
+            close(fildes[0]);
+            execStage(argv1, envp1, place1, STDIN_FILENO, fildes[1]);
+        }
+        if (pid > 0)
+            timedForkDone(&timer);
         close(fildes[1]);
-        /* standard input now comes from pipe */
-        execvp(argv2[0], argv2);
+        PipeStage consumer = {second, argv2, openPipeStream(fildes[0], "r"), shellOut, 0, place2};
+        if (consumer.in == NULL)
+            return;
+        runStageHere(&consumer);
+        fclose(consumer.in);
+    }
+}
+
+void mypipe(char **argv1, char **argv2)
+{
+    StagePlacement place1, place2;
+    argv1 = takePlacement(argv1, &place1);
+    argv2 = argv1 ? takePlacement(argv2, &place2) : NULL;
+    if (argv2 == NULL)
+        return;
+
+    // NAME=value words after the placement apply to their own stage only
+    char **assigned1 = argv1, **assigned2 = argv2;
+    while (argv1[0] != NULL && isAssignment(argv1[0]))
+        argv1++;
+    while (argv2[0] != NULL && isAssignment(argv2[0]))
+        argv2++;
+    int count1 = argv1 - assigned1, count2 = argv2 - assigned2;
+    if (argv1[0] == NULL || argv2[0] == NULL)
+    {
+        printf("-myShell: syntax error near '|'\n");
+        return;
     }
+    if (pipePinAuto)
+        autoPlace(&place1, &place2);
+
+    BuiltinFunc first = findBuiltin(argv1[0]);
+    BuiltinFunc second = findBuiltin(argv2[0]);
+    statsAdd(first ? STAT_COMMANDS_BUILTIN : STAT_COMMANDS_EXTERNAL, 1);
+    statsAdd(second ? STAT_COMMANDS_BUILTIN : STAT_COMMANDS_EXTERNAL, 1);
+    statsAdd(STAT_FORKS, (first == NULL) + (second == NULL));
+
+    // An external stage gets its assignments in its environment, built before fork.
+    // Builtin stages share the variable table, so their assignments are exported for
+    // as long as the pipeline runs.
+    char **envp = shellEnviron();
+    char **envp1 = !first && count1 > 0 ? overrideEnviron(envp, assigned1, count1) : envp;
+    char **envp2 = !second && count2 > 0 ? overrideEnviron(envp, assigned2, count2) : envp;
+    int exported1 = first ? count1 : 0, exported2 = second ? count2 : 0;
+    char *saved[exported1 + exported2 + 1];
+    int savedExported[exported1 + exported2 + 1];
+    applyAssignments(assigned1, exported1, saved, savedExported);
+    applyAssignments(assigned2, exported2, saved + exported1, savedExported + exported1);
+
+    runPipe(first, argv1, envp1, &place1, second, argv2, envp2, &place2);
+
+    restoreAssignments(assigned2, exported2, saved + exported1, savedExported + exported1);
+    restoreAssignments(assigned1, exported1, saved, savedExported);
 }
 
 void splitInputForPipe(char *input, char ***argv1, char ***argv2)
@@ -310,6 +1069,7 @@ void move(char **args)
     if (args == NULL || args[1] == NULL || args[2] == NULL)
     {
         printf("Usage: move <source> <destination>\n");
+        lastStatus = 1;
         return;
     }
 
@@ -317,6 +1077,7 @@ void move(char **args)
     if (sourcePath == NULL)
     {
         perror("Error: Failed to resolve source path");
+        lastStatus = 1;
         return;
     }
 
@@ -324,6 +1085,7 @@ void move(char **args)
     if (realpath(args[2], destPath) == NULL) // Try to resolve the destination path
     {
         perror("Error: Failed to resolve destination path");
+        lastStatus = 1;
         free(sourcePath);
         return;
     }
@@ -337,6 +1099,7 @@ void move(char **args)
         if (strlen(destPath) + strlen(sourceFileName) + 2 > PATH_MAX)
         {
             printf("Error: Destination path is too long\n");
+            lastStatus = 1;
             free(sourcePath);
             return;
         }
@@ -344,12 +1107,17 @@ void move(char **args)
         strcat(destPath, sourceFileName);
     }
 
+    struct stat sourceStat;
+    int sized = stat(sourcePath, &sourceStat) == 0;
     if (rename(sourcePath, destPath) != 0)
     {
         perror("Error: Failed to move the file");
+        lastStatus = 1;
     }
     else
     {
+        if (sized)
+            statsAdd(STAT_BYTES_MOVE, sourceStat.st_size);
         printf("File moved successfully from '%s' to '%s'\n", sourcePath, destPath);
     }
 
@@ -386,6 +1154,7 @@ void echoppend(char **args)
     if (file == NULL)
     {
         perror("Error opening file");
+        lastStatus = 1;
         return;
     }
 
@@ -406,15 +1175,12 @@ void echoppend(char **args)
     if (file == NULL)
     {
         perror("Error opening file for reading");
+        lastStatus = 1;
         return;
     }
 
     // Read and print the file's contents to the terminal
-    char buffer[1024]; // Buffer to store lines read from the file
-    while (fgets(buffer, sizeof(buffer), file) != NULL)
-    {
-        printf("%s", buffer); // Print the line
-    }
+    streamToOutput(file);
 
     fclose(file); // Close the file after reading
 }
@@ -432,6 +1198,7 @@ void echowrite(char **args)
     if (size < 2)
     {
         puts("Error: Not enough arguments provided.");
+        lastStatus = 1;
         return;
     }
 
@@ -451,6 +1218,7 @@ void echowrite(char **args)
     if (file == NULL)
     {
         perror("Error opening file");
+        lastStatus = 1;
         return;
     }
 
@@ -477,51 +1245,62 @@ void echowrite(char **args)
     if (file == NULL)
     {
         perror("Error opening file for reading");
+        lastStatus = 1;
         return;
     }
 
     // Print the new contents of the file to the terminal
-    char buffer[1024]; // Buffer to store lines read from the file
-    while (fgets(buffer, sizeof(buffer), file) != NULL)
-    {
-        printf("%s", buffer); // Print the line
-    }
+    streamToOutput(file);
 
     fclose(file); // Close the file after reading
 }
 
 void rd(char **args)
 {
-    FILE *file = fopen(args[1], "r"); // Attempt to open the file specified by the first argument
+    if (args[1] != NULL && args[2] != NULL)
+    {
+        readFiles(args + 1, 0);
+        return;
+    }
+
+    // Attempt to open the file specified by the first argument, or read the pipe without one
+    FILE *file = args[1] ? fopen(args[1], "r") : shellIn;
     if (file == NULL)
     {
         // If the file can't be opened, exit the function
         printf("File cannot be opened or does not exist.\n");
+        lastStatus = 1;
         return;
     }
 
-    char buffer[1024]; // Buffer to store file content
-    while (fgets(buffer, sizeof(buffer), file) != NULL)
-    {
-        // Read and print the file content
-        printf("%s", buffer);
-    }
+    // Read and print the file content in large blocks
+    statsAdd(STAT_BYTES_RD, streamToOutput(file));
 
-    fclose(file); // Close the file after reading
+    if (file != shellIn)
+        fclose(file); // Close the file after reading
 }
 
 void wordCount(char **args)
 {
-    // Attempt to open the file specified by the second argument
-    FILE *file = fopen(args[2], "r");
+    if (args[1] == NULL)
+        return;
+    if (args[2] != NULL && args[3] != NULL && (strcmp(args[1], "-l") == 0 || strcmp(args[1], "-w") == 0))
+    {
+        readFiles(args + 2, strcmp(args[1], "-l") == 0 ? 'l' : 'w');
+        return;
+    }
+
+    // Attempt to open the file specified by the second argument, or read the pipe without one
+    FILE *file = args[2] ? fopen(args[2], "r") : shellIn;
     if (file == NULL)
     {
         // If the file can't be opened or doesn't exist, exit the function
+        lastStatus = 1;
         return;
     }
 
     int count = 0; // Initialize count
-    char ch, prevCh = '\0';
+    int ch, prevCh = '\0';
 
     if (strcmp(args[1], "-l") == 0)
     {
@@ -558,8 +1337,6667 @@ void wordCount(char **args)
         }
     }
 
-    fclose(file); // Close the file
+    if (file != shellIn)
+        fclose(file); // Close the file
 
     // Print the count
-    printf("%d\n", count);
-}
\ No newline at end of file
+    fprintf(shellOut, "%d\n", count);
+}
+// Maps a whole file into memory, or reads 'inputFd' to the end when 'path' is NULL.
+// '*mapped' tells unmapInput whether the buffer came from mmap or malloc.
+static char *mapInput(const char *path, int inputFd, size_t *len, int *mapped)
+{
+    *len = 0;
+    *mapped = 0;
+    int fd = path ? open(path, O_RDONLY) : inputFd;
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (path && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return NULL;
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        *len = st.st_size;
+        *mapped = 1;
+        return data;
+    }
+
+    // Pipes, terminals and empty files are read into a growing buffer
+    size_t cap = 65536;
+    char *data = malloc(cap);
+    ssize_t n;
+    while (data != NULL && (n = read(fd, data + *len, cap - *len)) > 0)
+    {
+        *len += n;
+        if (*len == cap)
+        {
+            cap *= 2;
+            char *grown = realloc(data, cap);
+            if (grown == NULL)
+                free(data);
+            data = grown;
+        }
+    }
+    if (path)
+        close(fd);
+    return data;
+}
+
+static void unmapInput(char *data, size_t len, int mapped)
+{
+    if (mapped)
+        munmap(data, len);
+    else
+        free(data);
+}
+
+static int onlineCpus()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+#define GREP_MAX_ATOMS 63
+
+typedef struct
+{
+    uint64_t classMask[256]; // Bit i is set when atom i accepts the byte
+    uint64_t starMask;       // Atoms followed by '*'
+    int atoms;               // Number of atoms in the pattern
+    int anchorStart;         // Pattern starts with '^'
+    int anchorEnd;           // Pattern ends with '$'
+} GrepRegex;
+
+typedef struct
+{
+    const char *pattern;
+    size_t patternLen;
+    int literal; // Search with memmem, or grepFindCase under -i, instead of the automaton
+    int ignoreCase, invert, countOnly, lineNumbers;
+    GrepRegex regex;
+} GrepOptions;
+
+typedef struct
+{
+    const GrepOptions *opts;
+    const char *path; // NULL for the shell's standard input
+    int inputFd;      // Descriptor read when 'path' is NULL
+    int showName;     // Prefix results with the file name
+    int error;        // errno when the file could not be read, 0 otherwise
+    size_t lines;     // Lines searched so far, for -n across the blocks of a stream
+    size_t matches;   // Lines selected so far
+    char *out;        // Formatted results, printed once all workers finish
+    size_t outLen, outCap;
+} GrepJob;
+
+typedef struct
+{
+    GrepJob *jobs;
+    int count;
+    int next; // Index of the next unclaimed job, advanced atomically
+} GrepQueue;
+
+static int grepCompile(const char *pattern, int ignoreCase, GrepRegex *re)
+{
+    memset(re, 0, sizeof(*re));
+    const unsigned char *p = (const unsigned char *)pattern;
+    if (*p == '^')
+    {
+        re->anchorStart = 1;
+        p++;
+    }
+
+    while (*p)
+    {
+        if (*p == '$' && p[1] == '\0')
+        {
+            re->anchorEnd = 1;
+            break;
+        }
+        if (re->atoms == GREP_MAX_ATOMS)
+            return -1;
+
+        unsigned char set[256] = {0};
+        if (*p == '.')
+        {
+            memset(set, 1, sizeof(set));
+            p++;
+        }
+        else if (*p == '[')
+        {
+            p++;
+            int negate = 0;
+            if (*p == '^')
+            {
+                negate = 1;
+                p++;
+            }
+            const unsigned char *first = p;
+            while (*p && (*p != ']' || p == first))
+            {
+                int lo = *p, hi = *p;
+                if (p[1] == '-' && p[2] && p[2] != ']')
+                {
+                    hi = p[2];
+                    p += 2;
+                }
+                for (int c = lo; c <= hi; c++)
+                    set[c] = 1;
+                p++;
+            }
+            if (*p != ']')
+                return -1; // Unterminated class
+            p++;
+            if (negate)
+                for (int c = 0; c < 256; c++)
+                    set[c] = !set[c];
+        }
+        else
+        {
+            if (*p == '\\' && p[1])
+                p++;
+            set[*p++] = 1;
+        }
+
+        uint64_t bit = 1ULL << re->atoms;
+        if (*p == '*')
+        {
+            re->starMask |= bit;
+            p++;
+        }
+        for (int c = 0; c < 256; c++)
+        {
+            if (set[c] || (ignoreCase && (set[tolower(c)] || set[toupper(c)])))
+                re->classMask[c] |= bit;
+        }
+        re->atoms++;
+    }
+    return 0;
+}
+
+// Starred atoms may be skipped, so a state waiting on one also waits on the next atom
+static inline uint64_t grepClosure(const GrepRegex *re, uint64_t states)
+{
+    uint64_t prev;
+    do
+    {
+        prev = states;
+        states |= (states & re->starMask) << 1;
+    } while (states != prev);
+    return states;
+}
+
+static int grepMatchRegex(const GrepRegex *re, const char *line, size_t len)
+{
+    uint64_t accept = 1ULL << re->atoms;
+    uint64_t start = grepClosure(re, 1);
+    uint64_t states = start;
+
+    if (!re->anchorEnd && (states & accept))
+        return 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        uint64_t matched = states & re->classMask[(unsigned char)line[i]];
+        states = grepClosure(re, ((matched & ~re->starMask) << 1) | (matched & re->starMask));
+        if (!re->anchorStart)
+            states |= start; // A match may begin at any position
+        else if (states == 0)
+            return 0;
+        if (!re->anchorEnd && (states & accept))
+            return 1;
+    }
+    return (states & accept) != 0;
+}
+
+// memmem ignoring case: candidates are found by their first byte in either case
+static const char *grepFindCase(const char *data, size_t len, const char *pattern, size_t patternLen)
+{
+    if (patternLen == 0)
+        return data;
+    int lower = tolower((unsigned char)pattern[0]), upper = toupper((unsigned char)pattern[0]);
+    for (const char *pos = data, *last = data + len - patternLen; len >= patternLen && pos <= last; pos++)
+    {
+        if (*pos != lower && *pos != upper)
+            continue;
+        size_t i = 1;
+        while (i < patternLen && tolower((unsigned char)pos[i]) == tolower((unsigned char)pattern[i]))
+            i++;
+        if (i == patternLen)
+            return pos;
+    }
+    return NULL;
+}
+
+static const char *grepFind(const GrepOptions *opts, const char *data, size_t len)
+{
+    if (opts->ignoreCase)
+        return grepFindCase(data, len, opts->pattern, opts->patternLen);
+    return memmem(data, len, opts->pattern, opts->patternLen);
+}
+
+static int grepLineMatches(const GrepOptions *opts, const char *line, size_t len)
+{
+    if (opts->literal)
+        return grepFind(opts, line, len) != NULL;
+    return grepMatchRegex(&opts->regex, line, len);
+}
+
+static void grepEmit(GrepJob *job, const char *data, size_t len)
+{
+    if (job->outLen + len > job->outCap)
+    {
+        size_t cap = job->outCap ? job->outCap : 4096;
+        while (cap < job->outLen + len)
+            cap *= 2;
+        char *grown = realloc(job->out, cap);
+        if (grown == NULL)
+            return;
+        job->out = grown;
+        job->outCap = cap;
+    }
+    memcpy(job->out + job->outLen, data, len);
+    job->outLen += len;
+}
+
+static void grepEmitLine(GrepJob *job, size_t lineNo, const char *line, size_t len)
+{
+    char prefix[64];
+    if (job->showName)
+    {
+        grepEmit(job, job->path, strlen(job->path));
+        grepEmit(job, ":", 1);
+    }
+    if (job->opts->lineNumbers)
+        grepEmit(job, prefix, snprintf(prefix, sizeof(prefix), "%zu:", lineNo));
+    grepEmit(job, line, len);
+    grepEmit(job, "\n", 1);
+}
+
+static size_t countNewlines(const char *from, const char *to)
+{
+    size_t count = 0;
+    while (from < to && (from = memchr(from, '\n', to - from)) != NULL)
+    {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+// Searches whole lines; a stream is passed in blocks that end on a line end, and the
+// job carries the line and match counts from one block to the next
+static void grepSearch(GrepJob *job, const char *data, size_t len)
+{
+    const GrepOptions *opts = job->opts;
+    const char *end = data + len;
+    const char *pos = data;
+    size_t matches = 0;
+
+    if (opts->literal && !opts->invert)
+    {
+        // Let memmem find the next candidate and only then locate its line
+        const char *counted = data;
+        size_t lineNo = job->lines + 1;
+        while (pos < end)
+        {
+            const char *hit = grepFind(opts, pos, end - pos);
+            if (hit == NULL)
+                break;
+            const char *lineStart = hit;
+            while (lineStart > pos && lineStart[-1] != '\n')
+                lineStart--;
+            const char *lineEnd = memchr(hit, '\n', end - hit);
+            if (lineEnd == NULL)
+                lineEnd = end;
+
+            matches++;
+            if (!opts->countOnly)
+            {
+                if (opts->lineNumbers)
+                {
+                    lineNo += countNewlines(counted, lineStart);
+                    counted = lineStart;
+                }
+                grepEmitLine(job, lineNo, lineStart, lineEnd - lineStart);
+            }
+            pos = lineEnd + 1;
+        }
+        if (opts->lineNumbers)
+            job->lines = lineNo - 1 + countNewlines(counted, end);
+    }
+    else
+    {
+        size_t lineNo = job->lines;
+        while (pos < end)
+        {
+            const char *lineEnd = memchr(pos, '\n', end - pos);
+            if (lineEnd == NULL)
+                lineEnd = end;
+            lineNo++;
+            if (grepLineMatches(opts, pos, lineEnd - pos) != opts->invert)
+            {
+                matches++;
+                if (!opts->countOnly)
+                    grepEmitLine(job, lineNo, pos, lineEnd - pos);
+            }
+            pos = lineEnd + 1;
+        }
+        job->lines = lineNo;
+    }
+    job->matches += matches;
+}
+
+// Adds the -c count once the whole input has been searched
+static void grepFinish(GrepJob *job)
+{
+    if (job->opts->countOnly)
+    {
+        char count[32];
+        if (job->showName)
+        {
+            grepEmit(job, job->path, strlen(job->path));
+            grepEmit(job, ":", 1);
+        }
+        grepEmit(job, count, snprintf(count, sizeof(count), "%zu\n", job->matches));
+    }
+}
+
+// Standard input is searched in blocks as it arrives, carrying the unfinished last line
+// over to the next block, and each block's results are printed straight away. A reader
+// that goes away ends the search.
+static void grepStream(GrepJob *job)
+{
+    size_t cap = OUT_BUFF * 16, len = 0;
+    char *block = malloc(cap);
+    ssize_t n = 0;
+    if (block == NULL)
+        job->error = ENOMEM;
+    while (job->error == 0 && ((n = read(job->inputFd, block + len, cap - len)) > 0 || len > 0))
+    {
+        len += n > 0 ? n : 0;
+        char *last = n > 0 ? memrchr(block, '\n', len) : block + len - 1;
+        if (last == NULL)
+        {
+            if (len == cap)
+            {
+                // A line longer than the block
+                char *grown = realloc(block, cap * 2);
+                if (grown == NULL)
+                {
+                    job->error = ENOMEM;
+                    continue;
+                }
+                block = grown;
+                cap *= 2;
+            }
+            continue;
+        }
+        grepSearch(job, block, last + 1 - block);
+        len -= last + 1 - block;
+        memmove(block, last + 1, len);
+
+        fwrite(job->out, 1, job->outLen, shellOut);
+        job->outLen = 0;
+        if (fflush(shellOut) != 0)
+            break;
+    }
+    if (n < 0 && job->error == 0)
+        job->error = errno;
+    free(block);
+    grepFinish(job);
+}
+
+static void *grepWorker(void *arg)
+{
+    GrepQueue *queue = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+    {
+        GrepJob *job = &queue->jobs[index];
+        size_t len;
+        int mapped;
+        char *data = mapInput(job->path, job->inputFd, &len, &mapped);
+        if (data == NULL)
+        {
+            job->error = errno ? errno : ENOMEM;
+            continue;
+        }
+        grepSearch(job, data, len);
+        grepFinish(job);
+        unmapInput(data, len, mapped);
+    }
+    return NULL;
+}
+
+void grep(char **args)
+{
+    GrepOptions opts = {0};
+    int i = 1;
+
+    // Parse the flags, which may be combined as in "-vn"
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        for (char *flag = args[i] + 1; *flag; flag++)
+        {
+            if (*flag == 'c')
+                opts.countOnly = 1;
+            else if (*flag == 'n')
+                opts.lineNumbers = 1;
+            else if (*flag == 'v')
+                opts.invert = 1;
+            else if (*flag == 'i')
+                opts.ignoreCase = 1;
+            else
+            {
+                printf("-myShell: grep: invalid option -- '%c'\n", *flag);
+                lastStatus = 2;
+                return;
+            }
+        }
+    }
+
+    if (args[i] == NULL)
+    {
+        printf("Usage: grep [-c] [-n] [-v] [-i] pattern [file...]\n");
+        lastStatus = 2;
+        return;
+    }
+    opts.pattern = args[i++];
+    opts.patternLen = strlen(opts.pattern);
+    opts.literal = strpbrk(opts.pattern, ".[]*^$\\") == NULL;
+    if (!opts.literal && grepCompile(opts.pattern, opts.ignoreCase, &opts.regex) != 0)
+    {
+        printf("-myShell: grep: invalid pattern '%s'\n", opts.pattern);
+        lastStatus = 2;
+        return;
+    }
+
+    int files = 0;
+    while (args[i + files] != NULL)
+        files++;
+
+    GrepQueue queue = {0};
+    queue.count = files ? files : 1;
+    queue.jobs = calloc(queue.count, sizeof(GrepJob));
+    if (queue.jobs == NULL)
+    {
+        printf("-myShell: grep: %s\n", strerror(ENOMEM));
+        lastStatus = 2;
+        return;
+    }
+    for (int j = 0; j < queue.count; j++)
+    {
+        queue.jobs[j].opts = &opts;
+        queue.jobs[j].path = files ? args[i + j] : NULL;
+        queue.jobs[j].inputFd = fileno(shellIn);
+        queue.jobs[j].showName = files > 1;
+    }
+
+    if (files == 0)
+    {
+        grepStream(&queue.jobs[0]);
+        lastStatus = queue.jobs[0].error ? 2 : queue.jobs[0].matches == 0;
+        if (queue.jobs[0].error)
+            printf("-myShell: grep: (standard input): %s\n", strerror(queue.jobs[0].error));
+        else
+            fwrite(queue.jobs[0].out, 1, queue.jobs[0].outLen, shellOut);
+        free(queue.jobs[0].out);
+        free(queue.jobs);
+        return;
+    }
+
+    // Search the files in parallel, keeping the calling thread as one of the workers
+    int workers = onlineCpus();
+    if (workers > queue.count)
+        workers = queue.count;
+    pthread_t threads[workers];
+    int started = 0;
+    for (; started < workers - 1; started++)
+    {
+        if (pthread_create(&threads[started], NULL, grepWorker, &queue) != 0)
+            break;
+    }
+    grepWorker(&queue);
+    for (int j = 0; j < started; j++)
+        pthread_join(threads[j], NULL);
+
+    int failed = 0, selected = 0;
+    for (int j = 0; j < queue.count; j++)
+    {
+        selected |= queue.jobs[j].matches > 0;
+        if (queue.jobs[j].error)
+        {
+            printf("-myShell: grep: %s: %s\n", queue.jobs[j].path, strerror(queue.jobs[j].error));
+            failed = 1;
+        }
+        else
+            fwrite(queue.jobs[j].out, 1, queue.jobs[j].outLen, shellOut);
+        free(queue.jobs[j].out);
+    }
+    free(queue.jobs);
+    lastStatus = failed ? 2 : !selected; // As grep: 2 on errors, 1 when nothing was selected
+}
+
+static const Builtin builtins[] = {
+    {"echo", echo},
+    {"cd", cd},
+    {"cp", cp},
+    {"delete", delete},
+    {"move", move},
+    {"cat", echoppend},
+    {"wrt", echowrite},
+    {"rd", rd},
+    {"wc", wordCount},
+    {"grep", grep},
+    {"sort", sortFile},
+    {"memo", memo},
+    {"true", trueCommand},
+    {"false", falseCommand},
+    {"export", exportCommand},
+    {"unset", unsetCommand},
+    {"sum", sum},
+    {"pin", pin},
+    {"set", setCommand},
+    {"tee", teeCommand},
+    {"history", historyCommand},
+    {"find", findCommand},
+    {"du", du},
+    {"stats", stats},
+    {"cmp", cmp},
+    {"count", count},
+    {"split", split},
+};
+
+BuiltinFunc findBuiltin(const char *name)
+{
+    if (name == NULL)
+        return NULL;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(name, builtins[i].name) == 0)
+            return builtins[i].func;
+    }
+    return NULL;
+}
+
+// ---- Tab completion
+//
+// Every directory used for completion gets a prefix trie of its entries, rebuilt when
+// the directory's mtime changes. Builtin names have a trie of their own. A completion
+// walks the typed prefix in each relevant trie and follows the chain of nodes with a
+// single child, so its cost depends on the length of the words, not on their number.
+
+enum
+{
+    ENTRY_NONE,
+    ENTRY_FILE,
+    ENTRY_DIR
+};
+
+typedef struct
+{
+    char label;
+    unsigned char kind; // ENTRY_* for the word ending at this node
+    int child;          // First child in label order, -1 if none
+    int sibling;        // Next sibling, -1 if none
+} TrieNode;
+
+typedef struct
+{
+    TrieNode *nodes; // nodes[0] is the root
+    int count;
+    int capacity;
+} Trie;
+
+static int trieNode(Trie *trie, char label)
+{
+    if (trie->count == trie->capacity)
+    {
+        trie->capacity = trie->capacity ? trie->capacity * 2 : 256;
+        trie->nodes = realloc(trie->nodes, trie->capacity * sizeof(TrieNode));
+    }
+    trie->nodes[trie->count] = (TrieNode){label, ENTRY_NONE, -1, -1};
+    return trie->count++;
+}
+
+static void trieClear(Trie *trie)
+{
+    trie->count = 0;
+    trieNode(trie, '\0');
+}
+
+static void trieInsert(Trie *trie, const char *word, unsigned char kind)
+{
+    int node = 0;
+    for (; *word; word++)
+    {
+        // Children stay sorted so that listings come out in order
+        int prev = -1, next = trie->nodes[node].child;
+        while (next >= 0 && (unsigned char)trie->nodes[next].label < (unsigned char)*word)
+        {
+            prev = next;
+            next = trie->nodes[next].sibling;
+        }
+        if (next >= 0 && trie->nodes[next].label == *word)
+        {
+            node = next;
+            continue;
+        }
+        int created = trieNode(trie, *word); // May move trie->nodes, so link by index after
+        trie->nodes[created].sibling = next;
+        if (prev < 0)
+            trie->nodes[node].child = created;
+        else
+            trie->nodes[prev].sibling = created;
+        node = created;
+    }
+    if (trie->nodes[node].kind != ENTRY_DIR)
+        trie->nodes[node].kind = kind;
+}
+
+static int trieFind(const Trie *trie, const char *prefix, size_t len)
+{
+    int node = 0;
+    for (size_t i = 0; i < len && node >= 0; i++)
+    {
+        node = trie->nodes[node].child;
+        while (node >= 0 && trie->nodes[node].label != prefix[i])
+            node = trie->nodes[node].sibling;
+    }
+    return node;
+}
+
+// Lists the words below 'node', whose path spells word[0..depth)
+static void trieList(const Trie *trie, int node, char *word, size_t depth, size_t size,
+                     char ***list, int *count, int limit)
+{
+    if (trie->nodes[node].kind != ENTRY_NONE && *count < limit)
+    {
+        *list = realloc(*list, (*count + 1) * sizeof(char *));
+        (*list)[*count] = malloc(depth + 2);
+        memcpy((*list)[*count], word, depth);
+        strcpy((*list)[*count] + depth, trie->nodes[node].kind == ENTRY_DIR ? "/" : "");
+        (*count)++;
+    }
+    for (int child = trie->nodes[node].child; child >= 0 && *count < limit && depth + 1 < size;
+         child = trie->nodes[child].sibling)
+    {
+        word[depth] = trie->nodes[child].label;
+        trieList(trie, child, word, depth + 1, size, list, count, limit);
+    }
+}
+
+typedef struct
+{
+    char *path;
+    int commands; // Only executables, for PATH directories
+    struct timespec mtime;
+    unsigned long used;
+    Trie trie;
+} DirTrie;
+
+#define DIR_TRIES 64
+
+static DirTrie dirTries[DIR_TRIES];
+static unsigned long dirTrieClock;
+static Trie builtinTrie;
+
+static void loadDirTrie(DirTrie *entry)
+{
+    trieClear(&entry->trie);
+    DIR *dir = opendir(entry->path);
+    if (dir == NULL)
+        return;
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL)
+    {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+            continue;
+        int isDir = item->d_type == DT_DIR;
+        if (item->d_type == DT_LNK || item->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            isDir = fstatat(dirfd(dir), item->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (entry->commands && (isDir || faccessat(dirfd(dir), item->d_name, X_OK, 0) != 0))
+            continue;
+        trieInsert(&entry->trie, item->d_name, isDir ? ENTRY_DIR : ENTRY_FILE);
+    }
+    closedir(dir);
+}
+
+// The trie for 'path', reloaded only when the directory changed since it was built
+static const Trie *dirTrie(const char *path, int commands)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    DirTrie *entry = NULL, *oldest = &dirTries[0];
+    for (int i = 0; i < DIR_TRIES && entry == NULL; i++)
+    {
+        if (dirTries[i].path != NULL && dirTries[i].commands == commands && strcmp(dirTries[i].path, path) == 0)
+            entry = &dirTries[i];
+        else if (dirTries[i].used < oldest->used)
+            oldest = &dirTries[i];
+    }
+    if (entry == NULL)
+    {
+        entry = oldest;
+        free(entry->path);
+        entry->path = strdup(path);
+        entry->commands = commands;
+        entry->mtime.tv_sec = -1;
+    }
+    entry->used = ++dirTrieClock;
+    if (entry->mtime.tv_sec != st.st_mtim.tv_sec || entry->mtime.tv_nsec != st.st_mtim.tv_nsec)
+    {
+        entry->mtime = st.st_mtim;
+        loadDirTrie(entry);
+    }
+    return &entry->trie;
+}
+
+static int compareWords(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int completeLine(const char *line, size_t len, char *extension, size_t size, FILE *listing)
+{
+    extension[0] = '\0';
+
+    // The word under completion starts after the last blank; it names a command when
+    // it opens the line or follows a separator
+    size_t start = len;
+    while (start > 0 && !isspace((unsigned char)line[start - 1]))
+        start--;
+    size_t before = start;
+    while (before > 0 && isspace((unsigned char)line[before - 1]))
+        before--;
+    int command = before == 0 || strchr("|;&", line[before - 1]) != NULL;
+    const char *word = line + start;
+    size_t wordLen = len - start;
+
+    // Gather the tries to search and the part of the word they complete
+    const Trie *tries[DIR_TRIES + 1];
+    int tryCount = 0;
+    const char *slash = memrchr(word, '/', wordLen);
+    const char *prefix = word;
+    if (slash != NULL)
+    {
+        char dir[PATH_MAX];
+        size_t dirLen = slash == word ? 1 : (size_t)(slash - word);
+        if (dirLen >= sizeof(dir))
+            return 0;
+        memcpy(dir, word, dirLen);
+        dir[dirLen] = '\0';
+        prefix = slash + 1;
+        if ((tries[tryCount] = dirTrie(dir, 0)) != NULL)
+            tryCount++;
+    }
+    else if (command)
+    {
+        if (builtinTrie.count == 0)
+        {
+            trieClear(&builtinTrie);
+            for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+                trieInsert(&builtinTrie, builtins[i].name, ENTRY_FILE);
+        }
+        tries[tryCount++] = &builtinTrie;
+        const char *path = getVariable("PATH");
+        char *copy = strdup(path ? path : "/usr/local/bin:/usr/bin:/bin"), *saveptr;
+        for (char *dir = strtok_r(copy, ":", &saveptr); dir != NULL && tryCount < DIR_TRIES;
+             dir = strtok_r(NULL, ":", &saveptr))
+            if ((tries[tryCount] = dirTrie(dir, 1)) != NULL)
+                tryCount++;
+        free(copy);
+    }
+    else if ((tries[tryCount] = dirTrie(".", 0)) != NULL)
+        tryCount++;
+    size_t prefixLen = word + wordLen - prefix;
+
+    // The extension is the longest text that every match continues with
+    char common[PATH_MAX];
+    size_t commonLen = 0;
+    int matches = 0, kind = ENTRY_NONE;
+    for (int t = 0; t < tryCount; t++)
+    {
+        const Trie *trie = tries[t];
+        int node = trieFind(trie, prefix, prefixLen);
+        if (node < 0)
+            continue;
+        char found[PATH_MAX];
+        size_t foundLen = 0;
+        while (trie->nodes[node].kind == ENTRY_NONE && trie->nodes[node].child >= 0 &&
+               trie->nodes[trie->nodes[node].child].sibling < 0 && foundLen + 1 < sizeof(found))
+        {
+            node = trie->nodes[node].child;
+            found[foundLen++] = trie->nodes[node].label;
+        }
+        int unique = trie->nodes[node].kind != ENTRY_NONE && trie->nodes[node].child < 0;
+        if (matches == 0)
+        {
+            memcpy(common, found, foundLen);
+            commonLen = foundLen;
+            kind = unique ? trie->nodes[node].kind : ENTRY_NONE;
+            matches = unique ? 1 : 2;
+            continue;
+        }
+        // The same name in another directory is still the same command
+        size_t shared = 0;
+        while (shared < commonLen && shared < foundLen && common[shared] == found[shared])
+            shared++;
+        if (!(unique && kind != ENTRY_NONE && shared == commonLen && shared == foundLen))
+            matches = 2;
+        commonLen = shared;
+    }
+
+    if (matches > 0 && commonLen + 2 <= size)
+    {
+        memcpy(extension, common, commonLen);
+        extension[commonLen] = '\0';
+        if (matches == 1)
+            strcat(extension, kind == ENTRY_DIR ? "/" : " ");
+    }
+
+    if (listing != NULL && matches > 1)
+    {
+        // Only the listing enumerates, capped so that a bare Tab on a huge PATH stays quick
+        char **list = NULL, buffer[PATH_MAX];
+        int count = 0, limit = 200;
+        for (int t = 0; t < tryCount && count < limit; t++)
+        {
+            int node = trieFind(tries[t], prefix, prefixLen);
+            if (node < 0 || prefixLen >= sizeof(buffer))
+                continue;
+            memcpy(buffer, prefix, prefixLen);
+            trieList(tries[t], node, buffer, prefixLen, sizeof(buffer), &list, &count, limit);
+        }
+        qsort(list, count, sizeof(char *), compareWords);
+        for (int i = 0; i < count; i++)
+        {
+            if (i == 0 || strcmp(list[i], list[i - 1]) != 0)
+                fprintf(listing, "%s  ", list[i]);
+        }
+        fprintf(listing, count == limit ? "...\n" : "\n");
+        for (int i = 0; i < count; i++)
+            free(list[i]);
+        free(list);
+    }
+    return matches;
+}
+
+#define SORT_MIN_SLICE 16384            // Fewest lines worth handing to a sorting thread
+#define SORT_DEFAULT_CAP (256UL << 20) // Default memory cap before spilling runs to disk
+
+typedef struct
+{
+    int numeric, reverse, unique;
+    int keyField;      // 1-based field the key starts at
+    size_t memoryCap;  // Bytes of input plus line index sorted in memory at once
+    const char *tmpDir; // Where sorted runs are spilled
+} SortOptions;
+
+typedef struct
+{
+    const char *line; // Points into the mapped input or run, never copied
+    size_t len;       // Length without the newline
+    const char *key;
+    size_t keyLen;
+    double number; // Value of the key when sorting numerically
+} SortLine;
+
+typedef struct
+{
+    SortLine *lines;
+    size_t count;
+    const SortOptions *opts;
+} SortSlice;
+
+typedef struct
+{
+    const char *pos, *end; // Unread part of a mapped run
+    SortLine current;
+} SortRun;
+
+static void sortMakeLine(const SortOptions *opts, const char *line, size_t len, SortLine *out)
+{
+    const char *p = line, *end = line + len;
+    for (int field = 1; field < opts->keyField; field++)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        while (p < end && *p != ' ' && *p != '\t')
+            p++;
+    }
+    out->line = line;
+    out->len = len;
+    out->key = p;
+    out->keyLen = end - p;
+    out->number = 0;
+
+    if (opts->numeric)
+    {
+        // Parse the leading number by hand, the key is not NUL terminated
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        int negative = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            p++;
+        double value = 0, scale = 1;
+        for (; p < end && isdigit((unsigned char)*p); p++)
+            value = value * 10 + (*p - '0');
+        if (p < end && *p == '.')
+            for (p++; p < end && isdigit((unsigned char)*p); p++)
+                value += (*p - '0') * (scale /= 10);
+        out->number = negative ? -value : value;
+    }
+}
+
+static int sortCompareKeys(const SortLine *a, const SortLine *b, const SortOptions *opts)
+{
+    if (opts->numeric)
+        return (a->number > b->number) - (a->number < b->number);
+    size_t len = a->keyLen < b->keyLen ? a->keyLen : b->keyLen;
+    int cmp = memcmp(a->key, b->key, len);
+    if (cmp == 0)
+        cmp = (a->keyLen > b->keyLen) - (a->keyLen < b->keyLen);
+    return cmp;
+}
+
+static int sortCompareLines(const void *left, const void *right, void *arg)
+{
+    const SortLine *a = left, *b = right;
+    const SortOptions *opts = arg;
+    int cmp = sortCompareKeys(a, b, opts);
+    if (cmp == 0)
+    {
+        // Equal keys fall back to comparing whole lines so the order is deterministic
+        size_t len = a->len < b->len ? a->len : b->len;
+        cmp = memcmp(a->line, b->line, len);
+        if (cmp == 0)
+            cmp = (a->len > b->len) - (a->len < b->len);
+    }
+    return opts->reverse ? -cmp : cmp;
+}
+
+static void *sortSliceWorker(void *arg)
+{
+    SortSlice *slice = arg;
+    qsort_r(slice->lines, slice->count, sizeof(SortLine), sortCompareLines, (void *)slice->opts);
+    return NULL;
+}
+
+// Sorts slices of 'lines' on separate threads, then merges neighbouring slices bottom-up
+static void sortLines(SortLine *lines, size_t count, const SortOptions *opts)
+{
+    int parts = onlineCpus();
+    if ((size_t)parts > count / SORT_MIN_SLICE)
+        parts = count / SORT_MIN_SLICE;
+    SortLine *merged = parts > 1 ? malloc(count * sizeof(SortLine)) : NULL;
+    if (merged == NULL)
+    {
+        qsort_r(lines, count, sizeof(SortLine), sortCompareLines, (void *)opts);
+        return;
+    }
+
+    SortSlice slices[parts];
+    size_t bounds[parts + 1];
+    pthread_t threads[parts];
+    int started[parts];
+    for (int i = 0; i <= parts; i++)
+        bounds[i] = count * i / parts;
+    for (int i = 0; i < parts; i++)
+    {
+        slices[i] = (SortSlice){lines + bounds[i], bounds[i + 1] - bounds[i], opts};
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, sortSliceWorker, &slices[i]) == 0;
+        if (!started[i] && i > 0)
+            sortSliceWorker(&slices[i]);
+    }
+    sortSliceWorker(&slices[0]);
+    for (int i = 1; i < parts; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    for (int width = 1; width < parts; width *= 2)
+    {
+        for (int i = 0; i < parts; i += 2 * width)
+        {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i + width < parts ? i + width : parts];
+            size_t hi = bounds[i + 2 * width < parts ? i + 2 * width : parts];
+            size_t a = lo, b = mid, out = lo;
+            while (a < mid && b < hi)
+                merged[out++] = sortCompareLines(&lines[b], &lines[a], (void *)opts) < 0 ? lines[b++] : lines[a++];
+            memcpy(merged + out, lines + a, (mid - a) * sizeof(SortLine));
+            out += mid - a;
+            memcpy(merged + out, lines + b, (hi - b) * sizeof(SortLine));
+        }
+        memcpy(lines, merged, count * sizeof(SortLine));
+    }
+    free(merged);
+}
+
+// Writes one sorted line, dropping it under -u when its key repeats the previous one
+static void sortEmit(FILE *out, const SortLine *line, SortLine *previous, int *havePrevious, const SortOptions *opts)
+{
+    if (opts->unique && *havePrevious && sortCompareKeys(previous, line, opts) == 0)
+        return;
+    fwrite(line->line, 1, line->len, out);
+    fputc('\n', out);
+    *previous = *line;
+    *havePrevious = 1;
+}
+
+// Splits 'data' into line views, sorts them and writes them to 'out'
+static int sortChunk(const char *data, size_t len, FILE *out, const SortOptions *opts)
+{
+    size_t count = 0, cap = 1024;
+    SortLine *lines = malloc(cap * sizeof(SortLine));
+    const char *pos = data, *end = data + len;
+    while (lines != NULL && pos < end)
+    {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (eol == NULL)
+            eol = end;
+        if (count == cap)
+        {
+            cap *= 2;
+            SortLine *grown = realloc(lines, cap * sizeof(SortLine));
+            if (grown == NULL)
+                free(lines);
+            lines = grown;
+            if (lines == NULL)
+                break;
+        }
+        sortMakeLine(opts, pos, eol - pos, &lines[count++]);
+        pos = eol + 1;
+    }
+    if (lines == NULL)
+        return -1;
+
+    sortLines(lines, count, opts);
+    SortLine previous;
+    int havePrevious = 0;
+    for (size_t i = 0; i < count; i++)
+        sortEmit(out, &lines[i], &previous, &havePrevious, opts);
+    free(lines);
+    return 0;
+}
+
+// Returns the length of the longest prefix of 'data' made of whole lines that fits the cap
+static size_t sortChunkLength(const char *data, size_t len, const SortOptions *opts)
+{
+    size_t used = 0, lines = 0;
+    const char *pos = data, *end = data + len;
+    while (pos < end)
+    {
+        const char *eol = memchr(pos, '\n', end - pos);
+        size_t next = (eol ? eol + 1 : end) - data;
+        if (used > 0 && next + (lines + 1) * sizeof(SortLine) > opts->memoryCap)
+            break;
+        used = next;
+        lines++;
+        pos = data + next;
+    }
+    return used;
+}
+
+// Finds the end of the line at 'pos'; a run cut short may lack the final '\n'
+static const char *sortLineEnd(const char *pos, const char *end)
+{
+    const char *eol = memchr(pos, '\n', end - pos);
+    return eol ? eol : end;
+}
+
+// Merges the sorted runs to the shell's output. Every run is mapped before anything is
+// printed, so a run that cannot be read fails the sort instead of dropping its lines.
+// @return 0 on success, -1 with errno set if a run could not be mapped.
+static int sortMergeRuns(int *runFds, int runs, const SortOptions *opts)
+{
+    SortRun cursors[runs];
+    int heap[runs], heapSize = 0;
+    size_t sizes[runs];
+    char *maps[runs];
+
+    for (int i = 0; i < runs; i++)
+    {
+        struct stat st;
+        maps[i] = NULL;
+        if (fstat(runFds[i], &st) != 0 ||
+            (st.st_size > 0 &&
+             (maps[i] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, runFds[i], 0)) == MAP_FAILED))
+        {
+            int error = errno;
+            for (int j = 0; j < i; j++)
+                if (maps[j] != NULL)
+                    munmap(maps[j], sizes[j]);
+            errno = error;
+            return -1;
+        }
+        sizes[i] = st.st_size;
+        cursors[i].pos = maps[i];
+        cursors[i].end = maps[i] ? maps[i] + sizes[i] : NULL;
+    }
+
+#define SORT_RUN_LESS(x, y) (sortCompareLines(&cursors[x].current, &cursors[y].current, (void *)opts) < 0)
+    for (int i = 0; i < runs; i++)
+    {
+        if (cursors[i].pos == NULL || cursors[i].pos >= cursors[i].end)
+            continue;
+        const char *eol = sortLineEnd(cursors[i].pos, cursors[i].end);
+        sortMakeLine(opts, cursors[i].pos, eol - cursors[i].pos, &cursors[i].current);
+        cursors[i].pos = eol + 1;
+
+        // Sift the new run up the heap
+        int child = heapSize++;
+        heap[child] = i;
+        while (child > 0 && SORT_RUN_LESS(heap[child], heap[(child - 1) / 2]))
+        {
+            int parent = (child - 1) / 2, swap = heap[parent];
+            heap[parent] = heap[child];
+            heap[child] = swap;
+            child = parent;
+        }
+    }
+
+    SortLine previous;
+    int havePrevious = 0;
+    while (heapSize > 0)
+    {
+        SortRun *top = &cursors[heap[0]];
+        sortEmit(shellOut, &top->current, &previous, &havePrevious, opts);
+
+        if (top->pos < top->end)
+        {
+            const char *eol = sortLineEnd(top->pos, top->end);
+            sortMakeLine(opts, top->pos, eol - top->pos, &top->current);
+            top->pos = eol + 1;
+        }
+        else
+            heap[0] = heap[--heapSize];
+
+        // Sift the root down
+        int parent = 0;
+        while (1)
+        {
+            int smallest = parent, left = 2 * parent + 1, right = left + 1;
+            if (left < heapSize && SORT_RUN_LESS(heap[left], heap[smallest]))
+                smallest = left;
+            if (right < heapSize && SORT_RUN_LESS(heap[right], heap[smallest]))
+                smallest = right;
+            if (smallest == parent)
+                break;
+            int swap = heap[parent];
+            heap[parent] = heap[smallest];
+            heap[smallest] = swap;
+            parent = smallest;
+        }
+    }
+#undef SORT_RUN_LESS
+
+    for (int i = 0; i < runs; i++)
+        if (maps[i] != NULL)
+            munmap(maps[i], sizes[i]);
+    return 0;
+}
+
+static size_t parseSize(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+    switch (toupper((unsigned char)*unit))
+    {
+    case 'G':
+        value *= 1024;
+        /* fall through */
+    case 'M':
+        value *= 1024;
+        /* fall through */
+    case 'K':
+        value *= 1024;
+    }
+    return value > 0 ? (size_t)value : 0;
+}
+
+// Hands out successive chunks of whole lines that fit the memory cap, either as slices
+// of a mapped file or by refilling a buffer from a pipe
+typedef struct
+{
+    char *data;
+    size_t len;
+    int mapped;
+    size_t consumed; // Bytes of 'data' already handed out
+    int fd;          // Pipe being read, or -1 for a mapped file
+    size_t cap;      // Size of the pipe buffer
+    int eof;
+} SortInput;
+
+static int sortNextChunk(SortInput *in, const SortOptions *opts, const char **chunk, size_t *chunkLen)
+{
+    if (in->fd >= 0)
+    {
+        // Drop the chunk handed out last time and top the buffer up
+        memmove(in->data, in->data + in->consumed, in->len - in->consumed);
+        in->len -= in->consumed;
+        in->consumed = 0;
+        while (1)
+        {
+            while (!in->eof && in->len < in->cap)
+            {
+                ssize_t n = read(in->fd, in->data + in->len, in->cap - in->len);
+                if (n <= 0)
+                    in->eof = 1;
+                else
+                    in->len += n;
+            }
+            if (in->eof || memrchr(in->data, '\n', in->len) != NULL)
+                break;
+
+            // A single line longer than the buffer
+            char *grown = realloc(in->data, in->cap * 2);
+            if (grown == NULL)
+            {
+                in->eof = 1;
+                break;
+            }
+            in->data = grown;
+            in->cap *= 2;
+        }
+    }
+
+    const char *start = in->data + in->consumed;
+    size_t available = in->len - in->consumed;
+    if (in->fd >= 0 && !in->eof)
+        available = (char *)memrchr(start, '\n', available) - start + 1; // Whole lines only
+    *chunk = start;
+    *chunkLen = sortChunkLength(start, available, opts);
+    in->consumed += *chunkLen;
+    return *chunkLen > 0;
+}
+
+static int sortInputDone(const SortInput *in)
+{
+    return in->consumed == in->len && (in->fd < 0 || in->eof);
+}
+
+void sortFile(char **args)
+{
+    SortOptions opts = {0, 0, 0, 1, SORT_DEFAULT_CAP, NULL};
+    const char *path = NULL;
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-k") == 0 && args[i + 1] != NULL)
+            opts.keyField = atoi(args[++i]);
+        else if (strcmp(args[i], "-S") == 0 && args[i + 1] != NULL)
+            opts.memoryCap = parseSize(args[++i]);
+        else if (strcmp(args[i], "-T") == 0 && args[i + 1] != NULL)
+            opts.tmpDir = args[++i];
+        else if (args[i][0] == '-' && args[i][1] != '\0')
+        {
+            for (char *flag = args[i] + 1; *flag; flag++)
+            {
+                if (*flag == 'n')
+                    opts.numeric = 1;
+                else if (*flag == 'r')
+                    opts.reverse = 1;
+                else if (*flag == 'u')
+                    opts.unique = 1;
+                else
+                {
+                    printf("Usage: sort [-n] [-r] [-u] [-k field] [-S size] [-T dir] [file]\n");
+                    lastStatus = 1;
+                    return;
+                }
+            }
+        }
+        else
+            path = args[i];
+    }
+    if (opts.keyField < 1)
+        opts.keyField = 1;
+    if (opts.memoryCap < 4096)
+        opts.memoryCap = 4096;
+    if (opts.tmpDir == NULL)
+        opts.tmpDir = getVariable("TMPDIR") ? getVariable("TMPDIR") : "/tmp";
+
+    SortInput input = {0};
+    input.fd = -1;
+    if (path != NULL)
+    {
+        input.data = mapInput(path, -1, &input.len, &input.mapped);
+        if (input.data == NULL)
+        {
+            printf("-myShell: sort: %s: %s\n", path, strerror(errno));
+            lastStatus = 1;
+            return;
+        }
+    }
+    else
+    {
+        input.fd = fileno(shellIn);
+        input.cap = opts.memoryCap / 2; // Leave the other half for the line index
+        input.data = malloc(input.cap);
+        if (input.data == NULL)
+        {
+            printf("-myShell: sort: %s\n", strerror(ENOMEM));
+            lastStatus = 1;
+            return;
+        }
+    }
+
+    const char *chunk;
+    size_t chunkLen;
+    if (!sortNextChunk(&input, &opts, &chunk, &chunkLen))
+    {
+        unmapInput(input.data, input.len, input.mapped);
+        return;
+    }
+    if (sortInputDone(&input))
+    {
+        if (sortChunk(chunk, chunkLen, shellOut, &opts) != 0)
+        {
+            printf("-myShell: sort: %s\n", strerror(ENOMEM));
+            lastStatus = 1;
+        }
+        unmapInput(input.data, input.len, input.mapped);
+        return;
+    }
+
+    // Too big for the cap: spill sorted runs to unlinked temporary files, then merge them
+    int *runFds = NULL, runs = 0, failed = 0;
+    do
+    {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s/myShell-sort-XXXXXX", opts.tmpDir);
+        int fd = mkstemp(name);
+        int *grown = fd >= 0 ? realloc(runFds, (runs + 1) * sizeof(int)) : NULL;
+        if (grown == NULL)
+        {
+            printf("-myShell: sort: cannot create temporary file in %s\n", opts.tmpDir);
+            if (fd >= 0)
+            {
+                unlink(name);
+                close(fd);
+            }
+            failed = 1;
+            break;
+        }
+        unlink(name);
+        runFds = grown;
+        runFds[runs++] = fd;
+
+        // A run that is not written in full (ENOSPC, EIO) fails the whole sort
+        int copy = dup(fd);
+        FILE *run = copy >= 0 ? fdopen(copy, "w") : NULL;
+        int error = run == NULL ? errno : 0;
+        if (run == NULL && copy >= 0)
+            close(copy);
+        if (run != NULL)
+        {
+            setvbuf(run, NULL, _IOFBF, OUT_BUFF);
+            if (sortChunk(chunk, chunkLen, run, &opts) != 0)
+                error = ENOMEM;
+            else if (fflush(run) != 0 || ferror(run))
+                error = errno ? errno : EIO;
+            if (fclose(run) != 0 && error == 0)
+                error = errno;
+        }
+        if (error != 0)
+        {
+            printf("-myShell: sort: %s: %s\n", opts.tmpDir, strerror(error));
+            failed = 1;
+        }
+    } while (!failed && sortNextChunk(&input, &opts, &chunk, &chunkLen));
+
+    if (!failed && sortMergeRuns(runFds, runs, &opts) != 0)
+    {
+        printf("-myShell: sort: %s: %s\n", opts.tmpDir, strerror(errno));
+        failed = 1;
+    }
+    if (failed)
+        lastStatus = 1;
+    for (int i = 0; i < runs; i++)
+        close(runFds[i]);
+    free(runFds);
+    unmapInput(input.data, input.len, input.mapped);
+}
+
+// Reads a descriptor to its end in large blocks
+static void readAll(int fd, char **output, size_t *len)
+{
+    size_t cap = 0;
+    ssize_t n = 0;
+    do
+    {
+        *len += n;
+        if (cap - *len < OUT_BUFF)
+        {
+            char *grown = realloc(*output, cap ? cap * 2 : OUT_BUFF * 2);
+            if (grown == NULL)
+                break;
+            *output = grown;
+            cap = cap ? cap * 2 : OUT_BUFF * 2;
+        }
+    } while ((n = read(fd, *output + *len, cap - *len)) > 0);
+}
+
+int captureCommand(char **args, char **output, size_t *len)
+{
+    *output = NULL;
+    *len = 0;
+
+    BuiltinFunc builtin = findBuiltin(args[0]);
+    if (builtin != NULL)
+    {
+        // Builtins run in-process with their output stream pointed at a growing buffer
+        FILE *savedOut = shellOut;
+        shellOut = open_memstream(output, len);
+        if (shellOut == NULL)
+        {
+            shellOut = savedOut;
+            return -1;
+        }
+        lastStatus = 0;
+        builtin(args);
+        fclose(shellOut);
+        shellOut = savedOut;
+        return lastStatus;
+    }
+
+    int fildes[2];
+    if (pipe(fildes) != 0)
+        return -1;
+    char **envp = shellEnviron();
+    flushOutput();
+    ForkTimer timer;
+    pid_t pid = timedFork(&timer);
+    if (pid < 0)
+    {
+        close(fildes[0]);
+        close(fildes[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(fildes[0]);
+        execStage(args, envp, NULL, STDIN_FILENO, fildes[1]);
+    }
+    statsAdd(STAT_FORKS, 1);
+    timedForkDone(&timer);
+    close(fildes[1]);
+    readAll(fildes[0], output, len);
+    close(fildes[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#define MEMO_BUCKETS 1024
+#define MEMO_DEFAULT_BUDGET (64UL << 20)
+
+typedef struct MemoEntry
+{
+    char *key; // Working directory, command line and identity of its file arguments
+    size_t keyLen;
+    uint64_t hash;
+    char *output;
+    size_t outputLen;
+    struct MemoEntry *prev, *next; // LRU list, most recently used first
+    struct MemoEntry *chain;       // Next entry in the same bucket
+} MemoEntry;
+
+typedef struct
+{
+    MemoEntry *buckets[MEMO_BUCKETS];
+    MemoEntry *head, *tail;
+    size_t bytes;  // Output bytes held in memory
+    size_t budget; // Bytes held before the least recently used entries are evicted
+    unsigned long hits, misses, diskHits;
+    char *diskDir; // Optional directory mirroring the cache, NULL when off
+} MemoCache;
+
+static MemoCache memoCache = {.budget = MEMO_DEFAULT_BUDGET};
+
+static uint64_t hashBytes(const char *data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The key names the working directory and every argument, and for arguments that are
+// files also their device, inode, size and modification time, so that editing a file
+// invalidates its entries and relative paths are told apart after a cd
+static char *memoKey(char **args, size_t *len)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return NULL; // No stable directory to key on: run the command uncached
+    char *key = NULL;
+    FILE *stream = open_memstream(&key, len);
+    if (stream == NULL)
+        return NULL;
+    fprintf(stream, "%s\n", cwd);
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        struct stat st;
+        fprintf(stream, "%s\n", args[i]);
+        if (i > 0 && stat(args[i], &st) == 0)
+            fprintf(stream, "@%lu:%lu:%lld:%ld.%09ld\n", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+                    (long long)st.st_size, (long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+    fclose(stream);
+    return key;
+}
+
+static void memoUnlink(MemoEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        memoCache.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        memoCache.tail = entry->prev;
+}
+
+static void memoPushFront(MemoEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = memoCache.head;
+    if (memoCache.head)
+        memoCache.head->prev = entry;
+    memoCache.head = entry;
+    if (memoCache.tail == NULL)
+        memoCache.tail = entry;
+}
+
+static void memoRemove(MemoEntry *entry)
+{
+    MemoEntry **link = &memoCache.buckets[entry->hash % MEMO_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+    memoUnlink(entry);
+    memoCache.bytes -= entry->outputLen;
+    free(entry->key);
+    free(entry->output);
+    free(entry);
+}
+
+static MemoEntry *memoFind(const char *key, size_t keyLen, uint64_t hash)
+{
+    for (MemoEntry *entry = memoCache.buckets[hash % MEMO_BUCKETS]; entry; entry = entry->chain)
+    {
+        if (entry->hash == hash && entry->keyLen == keyLen && memcmp(entry->key, key, keyLen) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Takes ownership of 'key' and 'output'
+static void memoInsert(char *key, size_t keyLen, uint64_t hash, char *output, size_t outputLen)
+{
+    MemoEntry *entry = outputLen <= memoCache.budget ? malloc(sizeof(MemoEntry)) : NULL;
+    if (entry == NULL)
+    {
+        free(key);
+        free(output);
+        return;
+    }
+    while (memoCache.tail != NULL && memoCache.bytes + outputLen > memoCache.budget)
+        memoRemove(memoCache.tail);
+
+    *entry = (MemoEntry){key, keyLen, hash, output, outputLen, NULL, NULL, NULL};
+    entry->chain = memoCache.buckets[hash % MEMO_BUCKETS];
+    memoCache.buckets[hash % MEMO_BUCKETS] = entry;
+    memoPushFront(entry);
+    memoCache.bytes += outputLen;
+}
+
+// Disk entries are "<key length>\n<key><output>" in a file named after the key hash
+static void memoDiskPath(char *path, size_t size, uint64_t hash)
+{
+    snprintf(path, size, "%s/%016llx", memoCache.diskDir, (unsigned long long)hash);
+}
+
+static int memoDiskLoad(const char *key, size_t keyLen, uint64_t hash, char **output, size_t *outputLen)
+{
+    char path[PATH_MAX];
+    memoDiskPath(path, sizeof(path), hash);
+    size_t len;
+    int mapped;
+    char *data = mapInput(path, -1, &len, &mapped);
+    if (data == NULL)
+        return 0;
+
+    char *header = memchr(data, '\n', len);
+    int found = header != NULL && (size_t)strtoul(data, NULL, 10) == keyLen &&
+                (size_t)(header + 1 - data) + keyLen <= len && memcmp(header + 1, key, keyLen) == 0;
+    if (found)
+    {
+        char *body = header + 1 + keyLen;
+        *outputLen = data + len - body;
+        *output = malloc(*outputLen ? *outputLen : 1);
+        found = *output != NULL;
+        if (found)
+            memcpy(*output, body, *outputLen);
+    }
+    unmapInput(data, len, mapped);
+    return found;
+}
+
+static void memoDiskStore(const char *key, size_t keyLen, uint64_t hash, const char *output, size_t outputLen)
+{
+    char path[PATH_MAX], temp[PATH_MAX + 8];
+    memoDiskPath(path, sizeof(path), hash);
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        return;
+
+    // Written under a temporary name and renamed so other shells never see half an entry
+    char header[32];
+    struct iovec iov[3] = {{header, snprintf(header, sizeof(header), "%zu\n", keyLen)},
+                           {(void *)key, keyLen},
+                           {(void *)output, outputLen}};
+    ssize_t expected = iov[0].iov_len + keyLen + outputLen;
+    if (writev(fd, iov, 3) == expected)
+        rename(temp, path);
+    else
+        unlink(temp);
+    close(fd);
+}
+
+static void memoStats()
+{
+    unsigned long lookups = memoCache.hits + memoCache.misses;
+    size_t entries = 0;
+    for (MemoEntry *entry = memoCache.head; entry; entry = entry->next)
+        entries++;
+
+    fprintf(shellOut, "hits:      %lu (%lu from disk)\n", memoCache.hits, memoCache.diskHits);
+    fprintf(shellOut, "misses:    %lu\n", memoCache.misses);
+    fprintf(shellOut, "hit rate:  %.1f%%\n", lookups ? 100.0 * memoCache.hits / lookups : 0.0);
+    fprintf(shellOut, "entries:   %zu\n", entries);
+    fprintf(shellOut, "bytes:     %zu / %zu\n", memoCache.bytes, memoCache.budget);
+    fprintf(shellOut, "disk:      %s\n", memoCache.diskDir ? memoCache.diskDir : "off");
+}
+
+void memo(char **args)
+{
+    if (args[1] == NULL)
+    {
+        printf("Usage: memo <command> | memo stats | memo clear | memo budget <size> | memo disk <dir|off>\n");
+        lastStatus = 1;
+        return;
+    }
+    if (strcmp(args[1], "stats") == 0 && args[2] == NULL)
+    {
+        memoStats();
+        return;
+    }
+    if (strcmp(args[1], "clear") == 0 && args[2] == NULL)
+    {
+        while (memoCache.head != NULL)
+            memoRemove(memoCache.head);
+        memoCache.hits = memoCache.misses = memoCache.diskHits = 0;
+        return;
+    }
+    if (strcmp(args[1], "budget") == 0 && args[2] != NULL)
+    {
+        memoCache.budget = parseSize(args[2]);
+        while (memoCache.tail != NULL && memoCache.bytes > memoCache.budget)
+            memoRemove(memoCache.tail);
+        return;
+    }
+    if (strcmp(args[1], "disk") == 0 && args[2] != NULL)
+    {
+        free(memoCache.diskDir);
+        memoCache.diskDir = NULL;
+        if (strcmp(args[2], "off") != 0)
+        {
+            mkdir(args[2], 0700);
+            memoCache.diskDir = realpath(args[2], NULL);
+            if (memoCache.diskDir == NULL)
+            {
+                printf("-myShell: memo: %s: %s\n", args[2], strerror(errno));
+                lastStatus = 1;
+            }
+        }
+        return;
+    }
+
+    char **command = args + 1;
+    size_t keyLen;
+    char *key = memoKey(command, &keyLen);
+    uint64_t hash = key ? hashBytes(key, keyLen) : 0;
+
+    MemoEntry *entry = key ? memoFind(key, keyLen, hash) : NULL;
+    if (entry != NULL)
+    {
+        memoCache.hits++;
+        memoUnlink(entry);
+        memoPushFront(entry);
+        writeOutput(entry->output, entry->outputLen);
+        free(key);
+        return;
+    }
+
+    char *output;
+    size_t outputLen;
+    if (key != NULL && memoCache.diskDir != NULL && memoDiskLoad(key, keyLen, hash, &output, &outputLen))
+    {
+        memoCache.hits++;
+        memoCache.diskHits++;
+        writeOutput(output, outputLen);
+        memoInsert(key, keyLen, hash, output, outputLen);
+        return;
+    }
+
+    memoCache.misses++;
+    int status = captureCommand(command, &output, &outputLen);
+    lastStatus = status < 0 ? 1 : status;
+    if (output != NULL)
+        writeOutput(output, outputLen);
+    if (status != 0 || output == NULL || key == NULL)
+    {
+        // Failed commands, and commands run without a key, are not remembered
+        free(key);
+        free(output);
+        return;
+    }
+    if (memoCache.diskDir != NULL)
+        memoDiskStore(key, keyLen, hash, output, outputLen);
+    memoInsert(key, keyLen, hash, output, outputLen);
+}
+
+int lastStatus; // Exit status of the last command, 0 for success
+
+void trueCommand(char **args)
+{
+    (void)args;
+    lastStatus = 0;
+}
+
+void falseCommand(char **args)
+{
+    (void)args;
+    lastStatus = 1;
+}
+
+#define ARENA_BLOCK 65536
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size, used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for short-lived strings, released back to a mark in one step
+typedef struct
+{
+    ArenaBlock *first, *current;
+} Arena;
+
+typedef struct
+{
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+static Arena expandArena; // Holds the expanded words of the commands being run
+
+static void *arenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    ArenaBlock *block = arena->current;
+    while (block != NULL && block->used + size > block->size)
+    {
+        // Move on to the next block kept from earlier use, or add one
+        if (block->next == NULL)
+            break;
+        block = block->next;
+        block->used = 0;
+    }
+    if (block == NULL || block->used + size > block->size)
+    {
+        size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + blockSize);
+        if (fresh == NULL)
+            return NULL;
+        fresh->next = NULL;
+        fresh->size = blockSize;
+        fresh->used = 0;
+        if (block != NULL)
+        {
+            fresh->next = block->next;
+            block->next = fresh;
+        }
+        else
+        {
+            fresh->next = arena->first;
+            arena->first = fresh;
+        }
+        block = fresh;
+    }
+    arena->current = block;
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+static ArenaMark arenaMark(Arena *arena)
+{
+    ArenaMark mark = {arena->current, arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+static void arenaRelease(Arena *arena, ArenaMark mark)
+{
+    arena->current = mark.block ? mark.block : arena->first;
+    if (arena->current != NULL)
+        arena->current->used = mark.used;
+}
+
+typedef enum
+{
+    NODE_COMMAND, // words
+    NODE_SEQUENCE, // left ; right
+    NODE_AND,     // left && right
+    NODE_OR,      // left || right
+    NODE_FOR,     // for var in words; do body; done
+    NODE_WHILE,   // while condition; do body; done
+    NODE_IF       // if condition; then body; else otherwise; fi
+} NodeType;
+
+typedef struct Node
+{
+    NodeType type;
+    char **words; // Command words, or the word list of a for loop
+    char *var;    // Loop variable of a for loop
+    struct Node *left, *right;        // Operands of ;, && and ||
+    struct Node *condition, *body, *otherwise;
+} Node;
+
+typedef struct
+{
+    char *text;
+    int quoted; // Quoted words are never operators or reserved words
+} Token;
+
+typedef struct
+{
+    Token *tokens;
+    int count, pos;
+    int incomplete; // Ran out of input inside a construct
+    int error;      // Unexpected token
+} Parser;
+
+static void pushToken(Token **tokens, int *count, const char *text, size_t len, int quoted)
+{
+    Token *grown = realloc(*tokens, (*count + 1) * sizeof(Token));
+    if (grown == NULL)
+        return;
+    *tokens = grown;
+    grown[*count].text = strndup(text, len);
+    grown[*count].quoted = quoted;
+    (*count)++;
+}
+
+#define QUOTED_SUBSTITUTION '\x01' // Leads a word holding $(...) or `...` inside double quotes
+
+static int hasSubstitution(const char *word)
+{
+    return strstr(word, "$(") != NULL || strchr(word, '`') != NULL;
+}
+
+// Pushes an unquoted word with the double quotes inside it removed, as in pre"a b"post.
+// Quotes within a command substitution belong to the inner command and are kept.
+static void pushWordToken(Token **tokens, int *count, const char *text, size_t len)
+{
+    char word[len + 2];
+    size_t out = 1;
+    int inQuotes = 0, quotedSubstitution = 0, quoted = 0;
+    for (const char *c = text, *end = text + len; c < end; c++)
+    {
+        if ((*c == '$' && c[1] == '(') || *c == '`')
+        {
+            const char *close = substitutionEnd(c);
+            close = close && close < end ? close : end - 1;
+            quotedSubstitution |= inQuotes;
+            memcpy(word + out, c, close - c + 1);
+            out += close - c + 1;
+            c = close;
+        }
+        else if (*c == '\"')
+        {
+            inQuotes = !inQuotes;
+            quoted = 1;
+        }
+        else
+            word[out++] = *c;
+    }
+    word[0] = QUOTED_SUBSTITUTION; // Expansion keeps the output of a quoted substitution as one word
+    pushToken(tokens, count, word + !quotedSubstitution, out - !quotedSubstitution, quoted);
+}
+
+// Splits a line with splitArgument, then breaks unquoted ';', '|', '||' and '&&' out of
+// the words into tokens of their own
+static Token *tokenizeLine(const char *line, int *count)
+{
+    Token *tokens = NULL;
+    *count = 0;
+    char *copy = strdup(line);
+    char **words = copy ? splitArgument(copy) : NULL;
+    if (words == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
+
+    for (int i = 0; words[i] != NULL; i++)
+    {
+        char *word = words[i];
+        if (word > copy && word[-1] == '\"') // splitArgument stepped over an opening quote
+        {
+            if (hasSubstitution(word))
+            {
+                // Marked so that expansion keeps the output as one word
+                size_t len = strlen(word);
+                char marked[len + 2];
+                marked[0] = QUOTED_SUBSTITUTION;
+                memcpy(marked + 1, word, len + 1);
+                pushToken(&tokens, count, marked, len + 1, 1);
+            }
+            else
+                pushToken(&tokens, count, word, strlen(word), 1);
+            continue;
+        }
+        char *start = word;
+        int inQuotes = 0;
+        for (char *c = word; *c; c++)
+        {
+            // Operators inside a command substitution or quotes are not split out
+            if ((*c == '$' && c[1] == '(') || *c == '`')
+            {
+                const char *close = substitutionEnd(c);
+                c = close ? (char *)close : c + strlen(c) - 1;
+                continue;
+            }
+            if (*c == '\"')
+                inQuotes = !inQuotes;
+            if (inQuotes)
+                continue;
+            int opLen = 0;
+            if (*c == ';')
+                opLen = 1;
+            else if (*c == '|')
+                opLen = c[1] == '|' ? 2 : 1;
+            else if (*c == '&' && c[1] == '&')
+                opLen = 2;
+            if (opLen == 0)
+                continue;
+            if (c > start)
+                pushWordToken(&tokens, count, start, c - start);
+            pushToken(&tokens, count, c, opLen, 0);
+            c += opLen - 1;
+            start = c + 1;
+        }
+        if (*start)
+            pushWordToken(&tokens, count, start, strlen(start));
+    }
+    free(words);
+    free(copy);
+    return tokens;
+}
+
+static void freeTokens(Token *tokens, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(tokens[i].text);
+    free(tokens);
+}
+
+static void freeWords(char **words)
+{
+    for (int i = 0; words && words[i] != NULL; i++)
+        free(words[i]);
+    free(words);
+}
+
+static void freeNode(Node *node)
+{
+    if (node == NULL)
+        return;
+    freeWords(node->words);
+    free(node->var);
+    freeNode(node->left);
+    freeNode(node->right);
+    freeNode(node->condition);
+    freeNode(node->body);
+    freeNode(node->otherwise);
+    free(node);
+}
+
+static Node *newNode(NodeType type)
+{
+    Node *node = calloc(1, sizeof(Node));
+    if (node != NULL)
+        node->type = type;
+    return node;
+}
+
+static int atWord(Parser *p, const char *word)
+{
+    return p->pos < p->count && !p->tokens[p->pos].quoted && strcmp(p->tokens[p->pos].text, word) == 0;
+}
+
+static int atOperator(Parser *p)
+{
+    return atWord(p, ";") || atWord(p, "|") || atWord(p, "&&") || atWord(p, "||");
+}
+
+// Reserved words that close a list when they appear where a command would start
+static int atTerminator(Parser *p)
+{
+    return atWord(p, "do") || atWord(p, "done") || atWord(p, "then") || atWord(p, "else") ||
+           atWord(p, "elif") || atWord(p, "fi");
+}
+
+static int expectWord(Parser *p, const char *word)
+{
+    while (atWord(p, ";"))
+        p->pos++;
+    if (p->pos >= p->count)
+        p->incomplete = 1;
+    else if (!atWord(p, word))
+        p->error = 1;
+    else
+    {
+        p->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+static Node *parseList(Parser *p);
+
+static Node *parseIf(Parser *p)
+{
+    // Called just past "if" or "elif"
+    Node *node = newNode(NODE_IF);
+    node->condition = parseList(p);
+    if (!p->error && !p->incomplete && expectWord(p, "then"))
+        node->body = parseList(p);
+    if (p->error || p->incomplete)
+        return node;
+
+    if (atWord(p, "elif"))
+    {
+        p->pos++;
+        node->otherwise = parseIf(p); // The nested if consumes the closing "fi"
+        return node;
+    }
+    if (atWord(p, "else"))
+    {
+        p->pos++;
+        node->otherwise = parseList(p);
+    }
+    if (!p->error && !p->incomplete)
+        expectWord(p, "fi");
+    return node;
+}
+
+static Node *parseCommand(Parser *p)
+{
+    if (atWord(p, "for"))
+    {
+        p->pos++;
+        Node *node = newNode(NODE_FOR);
+        if (p->pos >= p->count)
+        {
+            p->incomplete = 1;
+            return node;
+        }
+        node->var = strdup(p->tokens[p->pos++].text);
+        if (!expectWord(p, "in"))
+            return node;
+
+        int count = 0;
+        node->words = malloc(sizeof(char *));
+        while (p->pos < p->count && !atWord(p, ";"))
+        {
+            node->words = realloc(node->words, (count + 2) * sizeof(char *));
+            node->words[count++] = strdup(p->tokens[p->pos++].text);
+        }
+        node->words[count] = NULL;
+
+        if (expectWord(p, "do"))
+            node->body = parseList(p);
+        if (!p->error && !p->incomplete)
+            expectWord(p, "done");
+        return node;
+    }
+
+    if (atWord(p, "while"))
+    {
+        p->pos++;
+        Node *node = newNode(NODE_WHILE);
+        node->condition = parseList(p);
+        if (!p->error && !p->incomplete && expectWord(p, "do"))
+            node->body = parseList(p);
+        if (!p->error && !p->incomplete)
+            expectWord(p, "done");
+        return node;
+    }
+
+    if (atWord(p, "if"))
+    {
+        p->pos++;
+        return parseIf(p);
+    }
+
+    // A simple command runs up to the next ';', '&&' or '||'; '|' stays inside it
+    int start = p->pos;
+    while (p->pos < p->count && !(atOperator(p) && !atWord(p, "|")))
+        p->pos++;
+    if (p->pos == start)
+    {
+        p->error = 1;
+        return NULL;
+    }
+
+    Node *node = newNode(NODE_COMMAND);
+    node->words = malloc((p->pos - start + 1) * sizeof(char *));
+    for (int i = start; i < p->pos; i++)
+        node->words[i - start] = strdup(p->tokens[i].text);
+    node->words[p->pos - start] = NULL;
+    return node;
+}
+
+static Node *parseAndOr(Parser *p)
+{
+    Node *left = parseCommand(p);
+    while (!p->error && !p->incomplete && (atWord(p, "&&") || atWord(p, "||")))
+    {
+        Node *node = newNode(atWord(p, "&&") ? NODE_AND : NODE_OR);
+        p->pos++;
+        node->left = left;
+        left = node;
+        if (p->pos >= p->count)
+            p->incomplete = 1;
+        else
+            node->right = parseCommand(p);
+    }
+    return left;
+}
+
+static Node *parseList(Parser *p)
+{
+    Node *list = NULL;
+    while (!p->error && !p->incomplete)
+    {
+        while (atWord(p, ";"))
+            p->pos++;
+        if (p->pos >= p->count || atTerminator(p))
+            break;
+        Node *command = parseAndOr(p);
+        if (list == NULL)
+            list = command;
+        else
+        {
+            Node *sequence = newNode(NODE_SEQUENCE);
+            sequence->left = list;
+            sequence->right = command;
+            list = sequence;
+        }
+    }
+    return list;
+}
+
+// Expands $NAME, ${NAME} and $? into 'out', or only measures the result when 'out' is NULL
+static size_t expandInto(const char *word, char *out)
+{
+    size_t len = 0;
+    char status[16];
+    for (const char *c = word; *c; c++)
+    {
+        const char *value = NULL;
+        if (*c == '$' && c[1] == '?')
+        {
+            snprintf(status, sizeof(status), "%d", lastStatus);
+            value = status;
+            c++;
+        }
+        else if (*c == '$' && (isalpha((unsigned char)c[1]) || c[1] == '_' || c[1] == '{'))
+        {
+            int braced = c[1] == '{';
+            const char *name = c + 1 + braced;
+            const char *end = name;
+            while (isalnum((unsigned char)*end) || *end == '_')
+                end++;
+            if (braced && *end != '}')
+            {
+                if (out)
+                    out[len] = *c;
+                len++;
+                continue; // Not a valid ${NAME}, keep the '$' literally
+            }
+            char nameCopy[end - name + 1];
+            memcpy(nameCopy, name, end - name);
+            nameCopy[end - name] = '\0';
+            value = getVariable(nameCopy);
+            if (value == NULL)
+                value = "";
+            c = end - 1 + braced;
+        }
+        else
+        {
+            if (out)
+                out[len] = *c;
+            len++;
+            continue;
+        }
+        size_t valueLen = strlen(value);
+        if (out)
+            memcpy(out + len, value, valueLen);
+        len += valueLen;
+    }
+    if (out)
+        out[len] = '\0';
+    return len;
+}
+
+static void appendBytes(char **buffer, size_t *len, size_t *cap, const char *data, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        *cap = (*len + n + 1) * 2;
+        *buffer = realloc(*buffer, *cap);
+    }
+    memcpy(*buffer + *len, data, n);
+    *len += n;
+    (*buffer)[*len] = '\0';
+}
+
+static int inSubshell; // Set in the child running a substitution; exit leaves only it
+
+// Runs a whole line in a forked subshell with its output going into a pipe, so that cd,
+// assignments and the like stay inside the substitution. Returns the line's status.
+static int captureSubshell(const char *line, char **output, size_t *len)
+{
+    int fildes[2];
+    if (pipe2(fildes, O_CLOEXEC) != 0)
+        return 1;
+    flushOutput(); // The child must not inherit pending output
+    statsAdd(STAT_FORKS, 1);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fildes[0]);
+        dup2(fildes[1], STDOUT_FILENO);
+        shellOut = stdout;
+        inSubshell = 1;
+        runLine((char *)line);
+        flushOutput();
+        _exit(lastStatus);
+    }
+    close(fildes[1]);
+    if (pid > 0)
+        readAll(fildes[0], output, len);
+    close(fildes[0]);
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static char **expandWords(char **words);
+
+// Builtins whose effect would outlive a substitution run inside the shell
+static int changesShellState(const char *name)
+{
+    static const char *const names[] = {"cd", "export", "unset", "set", "pin", "exit", NULL};
+    for (int i = 0; names[i] != NULL; i++)
+        if (strcmp(name, names[i]) == 0)
+            return 1;
+    return 0;
+}
+
+// Runs the text of a $(...) or `...` and returns its output. A lone simple command that
+// leaves the shell as it was is captured directly: a builtin in-process and an external
+// with a single fork and exec. Lists, assignments and builtins such as cd run in a forked
+// subshell, so their effects end with the substitution.
+static void substituteCommand(const char *text, size_t textLen, char **output, size_t *len)
+{
+    *output = NULL;
+    *len = 0;
+    char *inner = strndup(text, textLen);
+    int count;
+    Token *tokens = tokenizeLine(inner, &count);
+    // Checked before expanding too, so that nested substitutions do not run twice
+    int simple = tokens != NULL && count > 0 && !changesShellState(tokens[0].text) &&
+                 !isAssignment(tokens[0].text) && tokens[0].text[0] != '@';
+    for (int i = 0; simple && i < count; i++)
+    {
+        const char *word = tokens[i].text;
+        if (!tokens[i].quoted && (strchr(";|&", word[0]) || strcmp(word, "for") == 0 ||
+                                  strcmp(word, "while") == 0 || strcmp(word, "if") == 0))
+            simple = 0;
+    }
+
+    if (simple)
+    {
+        ArenaMark mark = arenaMark(&expandArena);
+        char *words[count + 1];
+        for (int i = 0; i < count; i++)
+            words[i] = tokens[i].text;
+        words[count] = NULL;
+        char **argv = expandWords(words);
+        if (argv != NULL && argv[0] != NULL && !isAssignment(argv[0]) && argv[0][0] != '@' &&
+            !changesShellState(argv[0]))
+        {
+            lastStatus = 0;
+            int status = captureCommand(argv, output, len);
+            if (status != 0)
+                lastStatus = status < 0 ? 1 : status;
+        }
+        else
+            simple = 0;
+        arenaRelease(&expandArena, mark);
+    }
+    if (!simple)
+        lastStatus = captureSubshell(inner, output, len);
+    freeTokens(tokens, count);
+    free(inner);
+
+    while (*len > 0 && (*output)[*len - 1] == '\n')
+        (*len)--;
+}
+
+// Expands a word holding command substitutions, running each one exactly once
+static char *expandSubstitutions(const char *word, size_t *len)
+{
+    char *out = NULL;
+    size_t cap = 0;
+    *len = 0;
+    appendBytes(&out, len, &cap, "", 0);
+    const char *literal = word;
+    for (const char *c = word; *c;)
+    {
+        const char *close = NULL;
+        if ((c[0] == '$' && c[1] == '(') || c[0] == '`')
+            close = substitutionEnd(c);
+        if (close == NULL)
+        {
+            c++;
+            continue;
+        }
+        const char *open = c + (c[0] == '$' ? 2 : 1);
+
+        // $NAME and $? in the text before the substitution, then its output
+        char segment[c - literal + 1];
+        memcpy(segment, literal, c - literal);
+        segment[c - literal] = '\0';
+        char expanded[expandInto(segment, NULL) + 1];
+        expandInto(segment, expanded);
+        appendBytes(&out, len, &cap, expanded, strlen(expanded));
+
+        char *output;
+        size_t outputLen;
+        substituteCommand(open, close - open, &output, &outputLen);
+        if (output != NULL)
+            appendBytes(&out, len, &cap, output, outputLen);
+        free(output);
+        c = literal = close + 1;
+    }
+    char expanded[expandInto(literal, NULL) + 1];
+    expandInto(literal, expanded);
+    appendBytes(&out, len, &cap, expanded, strlen(expanded));
+    return out;
+}
+
+static char *expandWord(const char *word)
+{
+    word += word[0] == QUOTED_SUBSTITUTION;
+    if (hasSubstitution(word))
+    {
+        size_t len;
+        char *text = expandSubstitutions(word, &len);
+        char *out = arenaAlloc(&expandArena, len + 1);
+        if (out != NULL)
+            memcpy(out, text, len + 1);
+        free(text);
+        return out ? out : "";
+    }
+    if (strchr(word, '$') == NULL)
+        return (char *)word;
+    char *out = arenaAlloc(&expandArena, expandInto(word, NULL) + 1);
+    if (out != NULL)
+        expandInto(word, out);
+    return out ? out : (char *)word;
+}
+
+// An unquoted substitution's output is split into words at blanks, except in the value
+// of an assignment
+static int splitsIntoFields(const char *word, int assignment)
+{
+    return !assignment && word[0] != QUOTED_SUBSTITUTION && hasSubstitution(word);
+}
+
+// Counts the blank separated fields of 'text', and when 'fields' is given, stores them,
+// terminating each in place
+static int splitFields(char *text, char **fields)
+{
+    int count = 0;
+    char *c = text;
+    while (1)
+    {
+        while (isspace((unsigned char)*c))
+            c++;
+        if (*c == '\0')
+            return count;
+        char *start = c;
+        while (*c && !isspace((unsigned char)*c))
+            c++;
+        if (fields != NULL)
+        {
+            fields[count] = start;
+            if (*c)
+                *c++ = '\0';
+        }
+        count++;
+    }
+}
+
+// Expands a command's words into an argument vector in the expansion arena
+static char **expandWords(char **words)
+{
+    int count = 0;
+    while (words[count] != NULL)
+        count++;
+
+    // NAME=value words before the command are assignments
+    int assignments = 0;
+    while (assignments < count && isAssignment(words[assignments] + (words[assignments][0] == QUOTED_SUBSTITUTION)))
+        assignments++;
+
+    // Substitutions run first and may produce any number of words
+    char **expanded = arenaAlloc(&expandArena, (count + 1) * sizeof(char *));
+    if (expanded == NULL)
+        return NULL;
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        expanded[i] = expandWord(words[i]);
+        total += splitsIntoFields(words[i], i < assignments) ? splitFields(expanded[i], NULL) : 1;
+    }
+    if (total == count)
+    {
+        for (int i = 0; i < count; i++)
+            if (splitsIntoFields(words[i], i < assignments))
+                splitFields(expanded[i], expanded + i);
+        expanded[count] = NULL;
+        return expanded;
+    }
+
+    char **argv = arenaAlloc(&expandArena, (total + 1) * sizeof(char *));
+    if (argv == NULL)
+        return NULL;
+    int argc = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (splitsIntoFields(words[i], i < assignments))
+            argc += splitFields(expanded[i], argv + argc);
+        else
+            argv[argc++] = expanded[i];
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+static void runExternal(char **argv, char **envp, const StagePlacement *placement)
+{
+    flushOutput(); // The child must not inherit pending output
+
+    ForkTimer timer;
+    pid_t pid = timedFork(&timer);
+    if (pid < 0)
+    {
+        perror("-myShell: fork");
+        lastStatus = 1;
+        return;
+    }
+    if (pid == 0)
+    {
+        int out = fileno(shellOut);
+        execStage(argv, envp, placement, STDIN_FILENO, out >= 0 ? out : STDOUT_FILENO);
+    }
+    statsAdd(STAT_FORKS, 1);
+    timedForkDone(&timer);
+    int status;
+    waitpid(pid, &status, 0);
+    lastStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static void runCommand(char **argv)
+{
+    if (argv[0] == NULL)
+        return;
+
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "|") == 0)
+        {
+            // Two stage pipeline, split in place at the first '|'. mypipe runs exactly two
+            // stages, so a further '|' is refused rather than passed on as an argument.
+            for (int j = i + 1; argv[j] != NULL; j++)
+            {
+                if (strcmp(argv[j], "|") == 0)
+                {
+                    printf("-myShell: syntax error near '|': only two-stage pipelines are supported\n");
+                    lastStatus = 2;
+                    return;
+                }
+            }
+            argv[i] = NULL;
+            lastStatus = 0;
+            statsAdd(STAT_PIPELINES, 1);
+            statsAdd(STAT_PIPELINE_STAGES, 2);
+            mypipe(argv, argv + i + 1);
+            int status;
+            while (wait(&status) > 0)
+                lastStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            argv[i] = "|";
+            return;
+        }
+    }
+
+    // Leading @cpu=, @nice= and @batch words, then NAME=value words
+    StagePlacement placement;
+    argv = takePlacement(argv, &placement);
+    if (argv == NULL)
+        return;
+    int assignments = 0;
+    while (argv[assignments] != NULL && isAssignment(argv[assignments]))
+        assignments++;
+    if (argv[assignments] == NULL)
+    {
+        // Nothing but assignments: they set shell variables
+        for (int i = 0; i < assignments; i++)
+            assignVariable(argv[i], 0);
+        lastStatus = 0;
+        return;
+    }
+    char **command = argv + assignments;
+
+    if (strcmp(command[0], "exit") == 0)
+    {
+        flushOutput();
+        if (inSubshell)
+            _exit(command[1] != NULL ? atoi(command[1]) : lastStatus);
+        logout(NULL);
+    }
+
+    BuiltinFunc builtin = findBuiltin(command[0]);
+    if (builtin == NULL)
+    {
+        char **envp = shellEnviron();
+        if (assignments > 0)
+            envp = overrideEnviron(envp, argv, assignments);
+        statsAdd(STAT_COMMANDS_EXTERNAL, 1);
+        runExternal(command, envp, &placement);
+        return;
+    }
+    statsAdd(STAT_COMMANDS_BUILTIN, 1);
+
+    char *saved[assignments + 1];
+    int savedExported[assignments + 1];
+    applyAssignments(argv, assignments, saved, savedExported);
+    lastStatus = 0;
+    PipeStage stage = {builtin, command, shellIn, shellOut, 0, &placement};
+    runStageHere(&stage);
+    restoreAssignments(argv, assignments, saved, savedExported);
+}
+
+static void execSimple(char **words)
+{
+    ArenaMark mark = arenaMark(&expandArena);
+    char **argv = expandWords(words);
+    if (argv != NULL)
+        runCommand(argv);
+    arenaRelease(&expandArena, mark);
+}
+
+// Recognises a for list made of a single "{first..last}" range
+static int parseRange(char **words, long *first, long *last)
+{
+    char *end;
+    if (words[0] == NULL || words[1] != NULL || words[0][0] != '{')
+        return 0;
+    *first = strtol(words[0] + 1, &end, 10);
+    if (end == words[0] + 1 || strncmp(end, "..", 2) != 0)
+        return 0;
+    char *lastStart = end + 2;
+    *last = strtol(lastStart, &end, 10);
+    return end != lastStart && strcmp(end, "}") == 0;
+}
+
+static void execNode(Node *node)
+{
+    if (node == NULL)
+        return;
+
+    switch (node->type)
+    {
+    case NODE_COMMAND:
+        execSimple(node->words);
+        break;
+    case NODE_SEQUENCE:
+        execNode(node->left);
+        execNode(node->right);
+        break;
+    case NODE_AND:
+        execNode(node->left);
+        if (lastStatus == 0)
+            execNode(node->right);
+        break;
+    case NODE_OR:
+        execNode(node->left);
+        if (lastStatus != 0)
+            execNode(node->right);
+        break;
+    case NODE_FOR:
+    {
+        // The loop variable is an ordinary shell variable, assigned before each pass as
+        // in sh: the body may change it, and it keeps its last value after the loop
+        long first, last;
+        char number[32];
+        lastStatus = 0;
+        if (parseRange(node->words, &first, &last))
+        {
+            // Ranges are counted through, never expanded into a word list
+            long step = first <= last ? 1 : -1;
+            for (long i = first;; i += step)
+            {
+                snprintf(number, sizeof(number), "%ld", i);
+                setVariable(node->var, number, -1);
+                execNode(node->body);
+                if (i == last)
+                    break;
+            }
+        }
+        else
+        {
+            for (int i = 0; node->words[i] != NULL; i++)
+            {
+                ArenaMark mark = arenaMark(&expandArena);
+                char *value = expandWord(node->words[i]); // Lives until the mark is released
+                if (splitsIntoFields(node->words[i], 0))
+                {
+                    // "for f in $(ls)" runs once per word of the output
+                    int fields = splitFields(value, NULL);
+                    char **list = arenaAlloc(&expandArena, (fields + 1) * sizeof(char *));
+                    if (list != NULL)
+                        splitFields(value, list);
+                    for (int f = 0; list != NULL && f < fields; f++)
+                    {
+                        setVariable(node->var, list[f], -1);
+                        execNode(node->body);
+                    }
+                }
+                else
+                {
+                    setVariable(node->var, value, -1);
+                    execNode(node->body);
+                }
+                arenaRelease(&expandArena, mark);
+            }
+        }
+        break;
+    }
+    case NODE_WHILE:
+    {
+        int bodyStatus = 0;
+        while (1)
+        {
+            execNode(node->condition);
+            if (lastStatus != 0)
+                break;
+            execNode(node->body);
+            bodyStatus = lastStatus;
+        }
+        lastStatus = bodyStatus;
+        break;
+    }
+    case NODE_IF:
+        execNode(node->condition);
+        if (lastStatus == 0)
+            execNode(node->body);
+        else if (node->otherwise != NULL)
+            execNode(node->otherwise);
+        else
+            lastStatus = 0;
+        break;
+    }
+}
+
+void runLine(char *input)
+{
+    char *line = strdup(input);
+    while (line != NULL)
+    {
+        int count;
+        Token *tokens = tokenizeLine(line, &count);
+        Parser parser = {tokens, count, 0, 0, 0};
+        Node *tree = parseList(&parser);
+        if (!parser.error && !parser.incomplete && parser.pos < count)
+            parser.error = 1; // A terminator such as "done" with nothing to close
+
+        if (parser.incomplete)
+        {
+            // Keep reading lines until the construct is closed. A line already ending in
+            // an operator or ';' continues with the next one as its operand.
+            const char *last = count > 0 && !tokens[count - 1].quoted ? tokens[count - 1].text : "";
+            int operand = strcmp(last, "&&") == 0 || strcmp(last, "||") == 0 || strcmp(last, "|") == 0 ||
+                          strcmp(last, ";") == 0;
+            freeNode(tree);
+            freeTokens(tokens, count);
+            printf("> ");
+            flushOutput();
+            char *more = getInputFromUser();
+            if (inputEnded)
+            {
+                // The "exit" standing in for end of input must not close the construct
+                printf("-myShell: syntax error: unexpected end of file\n");
+                lastStatus = 2;
+                free(more);
+                free(line);
+                return;
+            }
+            char *joined = malloc(strlen(line) + strlen(more) + 4);
+            if (joined != NULL)
+                sprintf(joined, operand ? "%s %s" : "%s ; %s", line, more);
+            else
+            {
+                printf("-myShell: %s\n", strerror(ENOMEM));
+                lastStatus = 1;
+            }
+            free(more);
+            free(line);
+            line = joined;
+            continue;
+        }
+
+        if (parser.error)
+            printf("-myShell: syntax error near '%s'\n",
+                   parser.pos < count ? tokens[parser.pos].text : "end of line");
+        else
+            execNode(tree); // Loop bodies run from this tree, never parsed again
+
+        freeNode(tree);
+        freeTokens(tokens, count);
+        free(line);
+        line = NULL;
+    }
+}
+
+typedef struct Variable
+{
+    char *pair;     // "NAME=value", handed to exec as is
+    size_t nameLen;
+    uint64_t hash;
+    int exported;
+    struct Variable *chain; // Next variable in the same bucket
+} Variable;
+
+static Variable **variables;
+static size_t variableBuckets, variableCount;
+static char **envCache; // NULL until needed and again after an exported variable changes
+
+static Variable **findVariable(const char *name, size_t nameLen, uint64_t hash)
+{
+    if (variableBuckets == 0)
+        return NULL;
+    Variable **link = &variables[hash & (variableBuckets - 1)];
+    while (*link != NULL &&
+           !((*link)->hash == hash && (*link)->nameLen == nameLen && memcmp((*link)->pair, name, nameLen) == 0))
+        link = &(*link)->chain;
+    return link;
+}
+
+static void growVariables()
+{
+    size_t buckets = variableBuckets ? variableBuckets * 2 : 256;
+    Variable **grown = calloc(buckets, sizeof(Variable *));
+    if (grown == NULL)
+        return;
+    for (size_t i = 0; i < variableBuckets; i++)
+    {
+        Variable *var = variables[i];
+        while (var != NULL)
+        {
+            Variable *next = var->chain;
+            var->chain = grown[var->hash & (buckets - 1)];
+            grown[var->hash & (buckets - 1)] = var;
+            var = next;
+        }
+    }
+    free(variables);
+    variables = grown;
+    variableBuckets = buckets;
+}
+
+static void invalidateEnviron()
+{
+    free(envCache);
+    envCache = NULL;
+}
+
+static int storeVariable(const char *name, size_t nameLen, const char *value, int exported)
+{
+    if (variableCount >= variableBuckets)
+        growVariables();
+    uint64_t hash = hashBytes(name, nameLen);
+    Variable **link = findVariable(name, nameLen, hash);
+    if (link == NULL)
+        return -1;
+
+    size_t valueLen = strlen(value);
+    char *pair = malloc(nameLen + valueLen + 2);
+    if (pair == NULL)
+        return -1;
+    memcpy(pair, name, nameLen);
+    pair[nameLen] = '=';
+    memcpy(pair + nameLen + 1, value, valueLen + 1);
+
+    Variable *var = *link;
+    if (var == NULL)
+    {
+        var = calloc(1, sizeof(Variable));
+        if (var == NULL)
+        {
+            free(pair);
+            return -1;
+        }
+        var->nameLen = nameLen;
+        var->hash = hash;
+        *link = var;
+        variableCount++;
+    }
+    else
+        free(var->pair);
+    int wasExported = var->exported; // The cached environment may point at the old pair
+    var->pair = pair;
+    if (exported >= 0)
+        var->exported = exported;
+    if (wasExported || var->exported)
+        invalidateEnviron();
+    return 0;
+}
+
+void initVariables()
+{
+    extern char **environ;
+    for (char **entry = environ; *entry != NULL; entry++)
+    {
+        char *equals = strchr(*entry, '=');
+        if (equals != NULL)
+            storeVariable(*entry, equals - *entry, equals + 1, 1);
+    }
+}
+
+const char *getVariable(const char *name)
+{
+    size_t nameLen = strlen(name);
+    Variable **link = findVariable(name, nameLen, hashBytes(name, nameLen));
+    return link && *link ? (*link)->pair + nameLen + 1 : NULL;
+}
+
+int setVariable(const char *name, const char *value, int exported)
+{
+    return storeVariable(name, strlen(name), value, exported);
+}
+
+void unsetVariable(const char *name)
+{
+    size_t nameLen = strlen(name);
+    Variable **link = findVariable(name, nameLen, hashBytes(name, nameLen));
+    if (link == NULL || *link == NULL)
+        return;
+    Variable *var = *link;
+    *link = var->chain;
+    if (var->exported)
+        invalidateEnviron();
+    free(var->pair);
+    free(var);
+    variableCount--;
+}
+
+int isExported(const char *name)
+{
+    size_t nameLen = strlen(name);
+    Variable **link = findVariable(name, nameLen, hashBytes(name, nameLen));
+    return link && *link && (*link)->exported;
+}
+
+int isAssignment(const char *word)
+{
+    if (!isalpha((unsigned char)*word) && *word != '_')
+        return 0;
+    while (isalnum((unsigned char)*word) || *word == '_')
+        word++;
+    return *word == '=';
+}
+
+void assignVariable(const char *assignment, int exported)
+{
+    const char *equals = strchr(assignment, '=');
+    storeVariable(assignment, equals - assignment, equals + 1, exported ? 1 : -1);
+}
+
+char **shellEnviron()
+{
+    if (envCache != NULL)
+        return envCache;
+
+    // Rebuilt only after an exported variable changed; the strings are shared, not copied
+    envCache = malloc((variableCount + 1) * sizeof(char *));
+    if (envCache == NULL)
+    {
+        static char *empty[] = {NULL};
+        return empty;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < variableBuckets; i++)
+        for (Variable *var = variables[i]; var != NULL; var = var->chain)
+            if (var->exported)
+                envCache[count++] = var->pair;
+    envCache[count] = NULL;
+    return envCache;
+}
+
+// Copies 'envp' into the expansion arena with the per-command assignments applied
+static char **overrideEnviron(char **envp, char **assignments, int count)
+{
+    size_t size = 0;
+    while (envp[size] != NULL)
+        size++;
+    char **merged = arenaAlloc(&expandArena, (size + count + 1) * sizeof(char *));
+    if (merged == NULL)
+        return envp;
+
+    size_t used = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t nameLen = strchr(envp[i], '=') - envp[i];
+        int overridden = 0;
+        for (int j = 0; j < count && !overridden; j++)
+            overridden = strncmp(assignments[j], envp[i], nameLen + 1) == 0;
+        if (!overridden)
+            merged[used++] = envp[i];
+    }
+    for (int j = 0; j < count; j++)
+        merged[used++] = assignments[j];
+    merged[used] = NULL;
+    return merged;
+}
+
+void exportCommand(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (char **entry = shellEnviron(); *entry != NULL; entry++)
+            fprintf(shellOut, "export %s\n", *entry);
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (isAssignment(args[i]))
+            assignVariable(args[i], 1);
+        else if (getVariable(args[i]) != NULL)
+            setVariable(args[i], getVariable(args[i]), 1);
+        else
+            setVariable(args[i], "", 1);
+    }
+}
+
+void unsetCommand(char **args)
+{
+    for (int i = 1; args[i] != NULL; i++)
+        unsetVariable(args[i]);
+}
+
+int copyRange(int in, off_t inOffset, int out, off_t outOffset, size_t len)
+{
+    // Let the kernel move the data (reflink or in-kernel copy) when it can
+    while (len > 0)
+    {
+        ssize_t copied = copy_file_range(in, &inOffset, out, &outOffset, len, 0);
+        if (copied <= 0)
+            break;
+        len -= copied;
+        statsAdd(STAT_BYTES_CP, copied);
+    }
+
+    // Filesystems or kernels without copy_file_range fall back to a buffered copy
+    char buffer[OUT_BUFF];
+    while (len > 0)
+    {
+        ssize_t n = pread(in, buffer, len < sizeof(buffer) ? len : sizeof(buffer), inOffset);
+        if (n <= 0)
+            return n == 0 ? 0 : -1;
+        for (ssize_t written = 0; written < n;)
+        {
+            ssize_t w = pwrite(out, buffer + written, n - written, outOffset + written);
+            if (w < 0)
+                return -1;
+            written += w;
+        }
+        inOffset += n;
+        outOffset += n;
+        len -= n;
+        statsAdd(STAT_BYTES_CP, n);
+    }
+    return 0;
+}
+
+int copyFile(const char *source, const char *destination)
+{
+    int in = open(source, O_RDONLY);
+    if (in < 0)
+        return -1;
+    struct stat st;
+    int out = fstat(in, &st) == 0 ? open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if (out < 0)
+    {
+        close(in);
+        return -1;
+    }
+    int result = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+        result = copyRange(in, 0, out, 0, st.st_size);
+    else
+    {
+        // Pipes and files like those in /proc report no size: copy until end of file
+        char buffer[OUT_BUFF];
+        ssize_t n;
+        while (result == 0 && (n = read(in, buffer, sizeof(buffer))) != 0)
+        {
+            if (n < 0)
+                result = errno == EINTR ? 0 : -1;
+            for (ssize_t written = 0; result == 0 && written < n;)
+            {
+                ssize_t w = write(out, buffer + written, n - written);
+                if (w < 0)
+                    result = -1;
+                else
+                    written += w;
+            }
+            if (result == 0 && n > 0)
+                statsAdd(STAT_BYTES_CP, n);
+        }
+    }
+    close(in);
+    if (close(out) != 0)
+        result = -1;
+    return result;
+}
+
+static int isPipe(int fd)
+{
+    struct stat st;
+    return fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Moves the rest of the input pipe 'in' to stdout and the files without it passing
+// through user space. The first file is filled with splice(2), the others are copied
+// from it with copyRange. stdout gets tee(2) when it is a pipe and sendfile(2) from the
+// first file otherwise.
+// @return 0 when done, -1 if the kernel refused before any data moved.
+static int teeSpliced(int in, int out, int *files, off_t *offsets, const char **names, int count)
+{
+    int outIsPipe = isPipe(out);
+    int moved = 0;
+    if (count == 0)
+    {
+        for (ssize_t n; (n = splice(in, NULL, out, NULL, 1 << 30, SPLICE_F_MOVE)) != 0; moved = 1)
+            if (n < 0)
+                return moved ? 0 : -1;
+        return 0;
+    }
+
+    while (1)
+    {
+        ssize_t n;
+        if (outIsPipe)
+        {
+            // Duplicate what the input holds onto stdout, then consume exactly that much
+            n = tee(in, out, 1 << 30, 0);
+            if (n < 0 && !moved)
+                return -1;
+            if (n <= 0)
+                return 0;
+            off_t start = offsets[0];
+            for (ssize_t left = n; left > 0;)
+            {
+                ssize_t m = splice(in, NULL, files[0], &offsets[0], left, SPLICE_F_MOVE);
+                if (m < 0)
+                {
+                    printf("-myShell: tee: %s: %s\n", names[0], strerror(errno));
+                    lastStatus = 1;
+                }
+                if (m <= 0)
+                    return 0;
+                left -= m;
+            }
+            for (int i = 1; i < count; i++)
+            {
+                if (copyRange(files[0], start, files[i], offsets[i], n) != 0)
+                {
+                    printf("-myShell: tee: %s: %s\n", names[i], strerror(errno));
+                    lastStatus = 1;
+                }
+                offsets[i] += n;
+            }
+        }
+        else
+        {
+            off_t start = offsets[0];
+            n = splice(in, NULL, files[0], &offsets[0], 1 << 30, SPLICE_F_MOVE);
+            if (n < 0 && !moved)
+                return -1;
+            if (n <= 0)
+                return 0;
+            for (int i = 1; i < count; i++)
+            {
+                if (copyRange(files[0], start, files[i], offsets[i], n) != 0)
+                {
+                    printf("-myShell: tee: %s: %s\n", names[i], strerror(errno));
+                    lastStatus = 1;
+                }
+                offsets[i] += n;
+            }
+            for (off_t from = start; from < start + n;)
+                if (sendfile(out, files[0], &from, start + n - from) <= 0)
+                    return 0;
+        }
+        moved = 1;
+    }
+}
+
+void teeCommand(char **args)
+{
+    int append = 0, first = 1;
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0)
+    {
+        append = 1;
+        first = 2;
+    }
+
+    int count = 0;
+    for (int i = first; args[i] != NULL; i++)
+        count++;
+    int *files = malloc((count + 1) * sizeof(int));
+    off_t *offsets = malloc((count + 1) * sizeof(off_t));
+    const char **names = malloc((count + 1) * sizeof(char *));
+    int opened = 0;
+    for (int i = first; args[i] != NULL; i++)
+    {
+        int fd = open(args[i], O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644); // Readable for copyRange and sendfile
+        if (fd < 0)
+        {
+            printf("-myShell: tee: %s: %s\n", args[i], strerror(errno));
+            lastStatus = 1;
+            continue;
+        }
+        files[opened] = fd;
+        names[opened] = args[i];
+        offsets[opened++] = append ? lseek(fd, 0, SEEK_END) : 0;
+    }
+
+    // The zero-copy path needs a pipe with nothing already buffered in stdio
+    int in = fileno(shellIn), out = fileno(shellOut);
+    fflush(shellOut);
+    int done = shellIn != stdin && isPipe(in) && out >= 0 &&
+               teeSpliced(in, out, files, offsets, names, opened) == 0;
+
+    char buffer[OUT_BUFF];
+    size_t n;
+    while (!done && (n = fread(buffer, 1, sizeof(buffer), shellIn)) > 0)
+    {
+        writeOutput(buffer, n);
+        for (int i = 0; i < opened; i++)
+        {
+            // A file that failed once is closed and dropped; the others keep going
+            for (size_t written = 0; files[i] >= 0 && written < n;)
+            {
+                ssize_t w = pwrite(files[i], buffer + written, n - written, offsets[i]);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                {
+                    printf("-myShell: tee: %s: %s\n", names[i], strerror(w < 0 ? errno : ENOSPC));
+                    lastStatus = 1;
+                    close(files[i]);
+                    files[i] = -1;
+                    break;
+                }
+                written += w;
+                offsets[i] += w;
+            }
+        }
+    }
+
+    for (int i = 0; i < opened; i++)
+        if (files[i] >= 0)
+            close(files[i]);
+    free(files);
+    free(offsets);
+    free(names);
+}
+
+#define BATCH_WINDOW 256                // Files loaded before their results are printed
+#define BATCH_WINDOW_BYTES (64UL << 20) // Memory a window may hold; later files are streamed
+#define BATCH_QUEUE_DEPTH 64            // Files with an operation in flight at once
+#define BATCH_MAX_FILE (8UL << 20)      // Larger files are streamed on their own instead
+
+typedef enum
+{
+    BATCH_OPEN_SOURCE,
+    BATCH_READ,
+    BATCH_OPEN_DEST,
+    BATCH_WRITE,
+    BATCH_DONE
+} BatchStage;
+
+typedef struct
+{
+    const char *path;
+    char *dest; // Destination of a copy, NULL when the file is only read
+    char *data;
+    size_t size, done;
+    int srcFd, destFd;
+    BatchStage stage;
+    int large; // Too big for the window, or not a regular file: left to the caller
+    int error; // errno of the failed step, 0 on success
+    size_t *windowBytes; // Bytes held by the window's files, shared by all of them
+} BatchFile;
+
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    unsigned queued; // Entries added since the last submit
+} Ring;
+
+static int ringInit(Ring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+                       ? ring->sqRing
+                       : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                              IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// io_uring exists since 5.1, but opening, reading and writing through it only since 5.6
+static int ringSupportsBatch(Ring *ring)
+{
+    static int supported = -1;
+    if (supported >= 0)
+        return supported;
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    supported = probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE};
+    for (int i = 0; supported && i < 3; i++)
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static void ringClose(Ring *ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Returns a cleared submission entry tagged with 'index', or NULL when the ring is full
+static struct io_uring_sqe *ringQueue(Ring *ring, int index)
+{
+    unsigned tail = *ring->sqTail + ring->queued;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries)
+        return NULL;
+    unsigned slot = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    ring->sqArray[slot] = slot;
+    ring->queued++;
+    return sqe;
+}
+
+// Submits the queued entries and waits for at least one completion
+static int ringSubmit(Ring *ring)
+{
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->queued, __ATOMIC_RELEASE);
+    int result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    ring->queued = 0;
+    return result < 0 && errno != EINTR ? -1 : 0;
+}
+
+// Queues the next operation of 'file'. Returns 1 if an operation was queued, 0 when the
+// file is done and -1 when the submission queue is full.
+static int batchQueueNext(Ring *ring, BatchFile *files, int index)
+{
+    BatchFile *file = &files[index];
+    if (file->stage == BATCH_DONE)
+        return 0;
+    struct io_uring_sqe *sqe = ringQueue(ring, index);
+    if (sqe == NULL)
+        return -1;
+
+    switch (file->stage)
+    {
+    case BATCH_OPEN_SOURCE:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)file->path;
+        sqe->open_flags = O_RDONLY;
+        break;
+    case BATCH_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = file->srcFd;
+        sqe->addr = (uintptr_t)(file->data + file->done);
+        sqe->len = file->size - file->done;
+        sqe->off = file->done;
+        break;
+    case BATCH_OPEN_DEST:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)file->dest;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->len = 0666;
+        break;
+    case BATCH_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = file->destFd;
+        sqe->addr = (uintptr_t)(file->data + file->done);
+        sqe->len = file->size - file->done;
+        sqe->off = file->done;
+        break;
+    case BATCH_DONE:
+        break;
+    }
+    return 1;
+}
+
+static void batchFinish(BatchFile *file, int error)
+{
+    if (file->srcFd >= 0)
+        close(file->srcFd);
+    if (file->destFd >= 0)
+        close(file->destFd);
+    file->srcFd = file->destFd = -1;
+    file->error = error;
+    file->stage = BATCH_DONE;
+}
+
+// Moves a file to its next stage after an operation returned 'result'
+static void batchAdvance(BatchFile *file, int result)
+{
+    if (result < 0)
+    {
+        batchFinish(file, -result);
+        return;
+    }
+
+    switch (file->stage)
+    {
+    case BATCH_OPEN_SOURCE:
+    {
+        struct stat st;
+        file->srcFd = result;
+        if (fstat(result, &st) != 0)
+        {
+            batchFinish(file, errno);
+            return;
+        }
+        // Files in /proc and the like report no size, so the caller reads them to the end
+        size_t size = st.st_size;
+        if (!S_ISREG(st.st_mode) || size == 0 || size > BATCH_MAX_FILE ||
+            __atomic_add_fetch(file->windowBytes, size, __ATOMIC_RELAXED) > BATCH_WINDOW_BYTES)
+        {
+            if (S_ISREG(st.st_mode) && size > 0 && size <= BATCH_MAX_FILE)
+                __atomic_sub_fetch(file->windowBytes, size, __ATOMIC_RELAXED);
+            file->large = 1;
+            batchFinish(file, 0);
+            return;
+        }
+        file->size = size;
+        file->data = malloc(file->size);
+        if (file->data == NULL)
+        {
+            batchFinish(file, ENOMEM);
+            return;
+        }
+        file->stage = BATCH_READ;
+        return;
+    }
+    case BATCH_READ:
+        file->done += result;
+        if (result == 0)
+            file->size = file->done; // The file shrank while being read
+        if (file->done < file->size)
+            return;
+        file->done = 0;
+        if (file->dest)
+            file->stage = BATCH_OPEN_DEST;
+        else
+            batchFinish(file, 0);
+        return;
+    case BATCH_OPEN_DEST:
+        file->destFd = result;
+        file->stage = BATCH_WRITE;
+        if (file->size == 0)
+            batchFinish(file, 0);
+        return;
+    case BATCH_WRITE:
+        file->done += result;
+        statsAdd(STAT_BYTES_CP, result);
+        if (file->done >= file->size)
+            batchFinish(file, 0);
+        return;
+    case BATCH_DONE:
+        return;
+    }
+}
+
+static int runBatchRing(BatchFile *files, int count)
+{
+    Ring ring;
+    if (ringInit(&ring, BATCH_QUEUE_DEPTH) != 0)
+        return -1;
+    if (!ringSupportsBatch(&ring))
+    {
+        ringClose(&ring);
+        return -1;
+    }
+
+    // Files whose next operation found the submission queue full, queued again first
+    int waiting[BATCH_QUEUE_DEPTH];
+    int waitCount = 0, next = 0, inFlight = 0;
+    while (next < count || inFlight > 0)
+    {
+        int stillWaiting = 0;
+        for (int i = 0; i < waitCount; i++)
+        {
+            int queued = batchQueueNext(&ring, files, waiting[i]);
+            if (queued < 0)
+                waiting[stillWaiting++] = waiting[i];
+            else if (queued == 0)
+                inFlight--;
+        }
+        waitCount = stillWaiting;
+
+        // Keep the queue full with files that have not started yet
+        while (next < count && inFlight < BATCH_QUEUE_DEPTH && waitCount == 0)
+        {
+            int queued = batchQueueNext(&ring, files, next);
+            if (queued < 0)
+                break;
+            next++;
+            inFlight += queued;
+        }
+        if (inFlight == 0)
+            continue;
+        if (ringSubmit(&ring) != 0)
+        {
+            // Operations may still be in flight: their buffers are given up rather than
+            // freed under the kernel, and the caller restarts the files on the thread pool
+            for (int i = 0; i < count; i++)
+                if (files[i].stage != BATCH_DONE)
+                    files[i].data = NULL;
+            ringClose(&ring);
+            return -1;
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            BatchFile *file = &files[cqe->user_data];
+            batchAdvance(file, cqe->res);
+            int queued = batchQueueNext(&ring, files, cqe->user_data);
+            if (queued < 0)
+                waiting[waitCount++] = cqe->user_data;
+            else if (queued == 0)
+                inFlight--;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    ringClose(&ring);
+    return 0;
+}
+
+typedef struct
+{
+    BatchFile *files;
+    int count;
+    int next; // Next unclaimed file, advanced atomically
+} BatchQueue;
+
+// Thread pool fallback: each worker takes whole files and runs their stages synchronously
+static void *batchWorker(void *arg)
+{
+    BatchQueue *queue = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+    {
+        BatchFile *file = &queue->files[index];
+        while (file->stage != BATCH_DONE)
+        {
+            int result;
+            switch (file->stage)
+            {
+            case BATCH_OPEN_SOURCE:
+                result = open(file->path, O_RDONLY);
+                break;
+            case BATCH_READ:
+                result = pread(file->srcFd, file->data + file->done, file->size - file->done, file->done);
+                break;
+            case BATCH_OPEN_DEST:
+                result = open(file->dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                break;
+            default:
+                result = pwrite(file->destFd, file->data + file->done, file->size - file->done, file->done);
+                break;
+            }
+            batchAdvance(file, result < 0 ? -errno : result);
+        }
+    }
+    return NULL;
+}
+
+static void runBatchThreads(BatchFile *files, int count)
+{
+    BatchQueue queue = {files, count, 0};
+    int workers = 4 * onlineCpus(); // Mostly waiting on I/O, so more than one per core
+    if (workers > count)
+        workers = count;
+    pthread_t threads[workers];
+    int started = 0;
+    for (; started < workers - 1; started++)
+        if (pthread_create(&threads[started], NULL, batchWorker, &queue) != 0)
+            break;
+    batchWorker(&queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// Opens, reads and (for copies) writes every file, through io_uring when the kernel
+// offers it and with a thread pool otherwise. MYSHELL_IO=threads forces the pool.
+static void runBatch(BatchFile *files, int count)
+{
+    size_t windowBytes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        files[i].srcFd = files[i].destFd = -1;
+        files[i].stage = BATCH_OPEN_SOURCE;
+        files[i].windowBytes = &windowBytes;
+    }
+    const char *mode = getVariable("MYSHELL_IO");
+    if (mode != NULL && strcmp(mode, "threads") == 0)
+        runBatchThreads(files, count);
+    else if (runBatchRing(files, count) != 0)
+    {
+        // Restart the files the ring left unfinished; their buffers were given up
+        windowBytes = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (files[i].stage == BATCH_DONE)
+            {
+                windowBytes += files[i].large ? 0 : files[i].size;
+                continue;
+            }
+            batchFinish(&files[i], 0);
+            files[i].done = 0;
+            files[i].stage = BATCH_OPEN_SOURCE;
+        }
+        runBatchThreads(files, count);
+    }
+}
+
+// Counts lines or words the way wordCount does for a single file
+static int countBuffer(const char *data, size_t len, int mode)
+{
+    int count = 0;
+    if (mode == 'l')
+    {
+        count = countNewlines(data, data + len);
+        if (len == 0 || data[len - 1] != '\n')
+            count++; // The last line, as wordCount counts it
+        return count;
+    }
+    int inWord = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (isspace((unsigned char)data[i]))
+            inWord = 0;
+        else if (inWord == 0)
+        {
+            inWord = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+void readFiles(char **paths, int countMode)
+{
+    int total = 0;
+    while (paths[total] != NULL)
+        total++;
+
+    for (int start = 0; start < total; start += BATCH_WINDOW)
+    {
+        int count = total - start < BATCH_WINDOW ? total - start : BATCH_WINDOW;
+        BatchFile files[count];
+        memset(files, 0, sizeof(files));
+        for (int i = 0; i < count; i++)
+            files[i].path = paths[start + i];
+        runBatch(files, count);
+
+        for (int i = 0; i < count; i++)
+        {
+            BatchFile *file = &files[i];
+            if (file->error)
+            {
+                printf("-myShell: %s: %s\n", file->path, strerror(file->error));
+                lastStatus = 1;
+            }
+            else if (file->large)
+            {
+                // Too big to hold in memory with the rest of the batch
+                size_t len;
+                int mapped;
+                char *data = mapInput(file->path, -1, &len, &mapped);
+                if (data == NULL)
+                {
+                    printf("-myShell: %s: %s\n", file->path, strerror(errno));
+                    lastStatus = 1;
+                }
+                else if (countMode)
+                    fprintf(shellOut, "%d %s\n", countBuffer(data, len, countMode), file->path);
+                else
+                {
+                    writeOutput(data, len);
+                    statsAdd(STAT_BYTES_RD, len);
+                }
+                if (data != NULL)
+                    unmapInput(data, len, mapped);
+            }
+            else if (countMode)
+                fprintf(shellOut, "%d %s\n", countBuffer(file->data, file->size, countMode), file->path);
+            else
+            {
+                writeOutput(file->data, file->size);
+                statsAdd(STAT_BYTES_RD, file->size);
+            }
+            free(file->data);
+        }
+    }
+}
+
+void copyIntoDirectory(char **args)
+{
+    int total = 0;
+    while (args[total + 1] != NULL)
+        total++;
+    const char *directory = args[total]; // Last argument, after the sources
+    total--;
+
+    struct stat st;
+    if (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("-myShell: cp: target '%s' is not a directory\n", directory);
+        lastStatus = 1;
+        return;
+    }
+
+    for (int start = 0; start < total; start += BATCH_WINDOW)
+    {
+        int count = total - start < BATCH_WINDOW ? total - start : BATCH_WINDOW;
+        BatchFile files[count];
+        memset(files, 0, sizeof(files));
+        for (int i = 0; i < count; i++)
+        {
+            char *source = args[1 + start + i];
+            char *slash = strrchr(source, '/');
+            files[i].path = source;
+            files[i].dest = malloc(strlen(directory) + strlen(source) + 2);
+            if (files[i].dest != NULL)
+                sprintf(files[i].dest, "%s/%s", directory, slash ? slash + 1 : source);
+        }
+        runBatch(files, count);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (files[i].large && copyFile(files[i].path, files[i].dest) != 0)
+                files[i].error = errno;
+            if (files[i].error)
+            {
+                printf("-myShell: cp: %s: %s\n", files[i].path, strerror(files[i].error));
+                lastStatus = 1;
+            }
+            free(files[i].data);
+            free(files[i].dest);
+        }
+    }
+}
+
+static uint32_t crc32cTable[8][256];
+
+static void crc32cInitTable()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32cTable[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xFF];
+}
+
+// Slicing-by-8 fallback for CPUs without SSE4.2
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t len)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, crc32cInitTable);
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xFF] ^ crc32cTable[6][(word >> 8) & 0xFF] ^
+              crc32cTable[5][(word >> 16) & 0xFF] ^ crc32cTable[4][(word >> 24) & 0xFF] ^
+              crc32cTable[3][(word >> 32) & 0xFF] ^ crc32cTable[2][(word >> 40) & 0xFF] ^
+              crc32cTable[1][(word >> 48) & 0xFF] ^ crc32cTable[0][word >> 56];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32cHardware(uint32_t crc, const unsigned char *data,
+                                                                 size_t len)
+{
+    uint64_t crc64 = crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int hardware = -1;
+    if (hardware < 0)
+        hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware)
+        return ~crc32cHardware(crc, data, len);
+#endif
+    return ~crc32cSoftware(crc, data, len);
+}
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxh64Round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64Merge(uint64_t acc, uint64_t value)
+{
+    return (acc ^ xxh64Round(0, value)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+uint64_t xxh64(const void *input, size_t len, uint64_t seed)
+{
+    const unsigned char *p = input, *end = p + len;
+    uint64_t hash;
+
+    if (len >= 32)
+    {
+        // Four independent lanes over 32 byte stripes
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2, v2 = seed + XXH_PRIME2, v3 = seed, v4 = seed - XXH_PRIME1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxh64Round(v1, read64(p));
+            v2 = xxh64Round(v2, read64(p + 8));
+            v3 = xxh64Round(v3, read64(p + 16));
+            v4 = xxh64Round(v4, read64(p + 24));
+        }
+        hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        hash = xxh64Merge(hash, v1);
+        hash = xxh64Merge(hash, v2);
+        hash = xxh64Merge(hash, v3);
+        hash = xxh64Merge(hash, v4);
+    }
+    else
+        hash = seed + XXH_PRIME5;
+    hash += len;
+
+    for (; p + 8 <= end; p += 8)
+        hash = rotl64(hash ^ xxh64Round(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (p + 4 <= end)
+    {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        hash = rotl64(hash ^ (word * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        hash = rotl64(hash ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr32(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256Software(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | data[4 * i + 1] << 16 | data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// SHA-NI rounds: each group of four rounds consumes one vector of the message schedule
+__attribute__((target("sha,sse4.1,ssse3"))) static void sha256Hardware(uint32_t state[8], const unsigned char *data,
+                                                                       size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                   // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                        // CDGH
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        __m128i savedAbef = state0, savedCdgh = state1;
+        __m128i msgs[4];
+        for (int group = 0; group < 16; group++)
+        {
+            if (group < 4)
+                msgs[group] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * group)), byteSwap);
+            __m128i msg = _mm_add_epi32(msgs[group & 3], _mm_loadu_si128((const __m128i *)&sha256K[4 * group]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (group >= 3 && group < 15)
+            {
+                __m128i *next = &msgs[(group + 1) & 3];
+                *next = _mm_add_epi32(*next, _mm_alignr_epi8(msgs[group & 3], msgs[(group - 1) & 3], 4));
+                *next = _mm_sha256msg2_epu32(*next, msgs[group & 3]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            if (group >= 1 && group < 13)
+                msgs[(group - 1) & 3] = _mm_sha256msg1_epu32(msgs[(group - 1) & 3], msgs[group & 3]);
+        }
+        state0 = _mm_add_epi32(state0, savedAbef);
+        state1 = _mm_add_epi32(state1, savedCdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);     // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);  // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);  // HGFE
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#endif
+
+void sha256(const void *input, size_t len, unsigned char digest[32])
+{
+    void (*compress)(uint32_t *, const unsigned char *, size_t) = sha256Software;
+#if defined(__x86_64__)
+    static int hardware = -1;
+    if (hardware < 0)
+    {
+        unsigned int eax, ebx, ecx, edx;
+        hardware = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29)) &&
+                   __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+    }
+    if (hardware)
+        compress = sha256Hardware;
+#endif
+
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const unsigned char *data = input;
+    size_t blocks = len / 64;
+    compress(state, data, blocks);
+
+    // Pad the tail: 0x80, zeros, then the length in bits, big endian
+    unsigned char tail[128] = {0};
+    size_t rest = len - blocks * 64;
+    memcpy(tail, data + blocks * 64, rest);
+    tail[rest] = 0x80;
+    size_t tailLen = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++)
+        tail[tailLen - 1 - i] = bits >> (8 * i);
+    compress(state, tail, tailLen / 64);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+typedef enum
+{
+    SUM_CRC32C,
+    SUM_XXH64,
+    SUM_SHA256
+} SumAlgorithm;
+
+typedef struct
+{
+    const char *path; // NULL for the shell's standard input
+    int inputFd;
+    SumAlgorithm algorithm;
+    char hex[65];
+    int failed;
+} SumJob;
+
+typedef struct
+{
+    SumJob *jobs;
+    int count;
+    int next; // Next unclaimed job, advanced atomically
+} SumQueue;
+
+static void formatDigest(SumAlgorithm algorithm, const char *data, size_t len, char *hex)
+{
+    if (algorithm == SUM_CRC32C)
+        sprintf(hex, "%08x", crc32c(0, data, len));
+    else if (algorithm == SUM_XXH64)
+        sprintf(hex, "%016llx", (unsigned long long)xxh64(data, len, 0));
+    else
+    {
+        unsigned char digest[32];
+        sha256(data, len, digest);
+        for (int i = 0; i < 32; i++)
+            sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static void *sumWorker(void *arg)
+{
+    SumQueue *queue = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+    {
+        SumJob *job = &queue->jobs[index];
+        size_t len;
+        int mapped;
+        char *data = mapInput(job->path, job->inputFd, &len, &mapped);
+        if (data == NULL)
+        {
+            job->failed = 1;
+            continue;
+        }
+        formatDigest(job->algorithm, data, len, job->hex);
+        unmapInput(data, len, mapped);
+    }
+    return NULL;
+}
+
+void sum(char **args)
+{
+    SumAlgorithm algorithm = SUM_SHA256;
+    int i = 1;
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0)
+    {
+        if (args[2] != NULL && strcmp(args[2], "crc32c") == 0)
+            algorithm = SUM_CRC32C;
+        else if (args[2] != NULL && strcmp(args[2], "xxh64") == 0)
+            algorithm = SUM_XXH64;
+        else if (args[2] == NULL || strcmp(args[2], "sha256") != 0)
+        {
+            printf("Usage: sum [-a crc32c|xxh64|sha256] [file...]\n");
+            lastStatus = 1;
+            return;
+        }
+        i = 3;
+    }
+
+    int files = 0;
+    while (args[i + files] != NULL)
+        files++;
+
+    SumQueue queue = {NULL, files ? files : 1, 0};
+    queue.jobs = calloc(queue.count, sizeof(SumJob));
+    if (queue.jobs == NULL)
+        return;
+    for (int j = 0; j < queue.count; j++)
+    {
+        queue.jobs[j].path = files ? args[i + j] : NULL;
+        queue.jobs[j].inputFd = fileno(shellIn);
+        queue.jobs[j].algorithm = algorithm;
+    }
+
+    // Hash the files in parallel, one file per worker at a time
+    int workers = onlineCpus();
+    if (workers > queue.count)
+        workers = queue.count;
+    pthread_t threads[workers];
+    int started = 0;
+    for (; started < workers - 1; started++)
+        if (pthread_create(&threads[started], NULL, sumWorker, &queue) != 0)
+            break;
+    sumWorker(&queue);
+    for (int j = 0; j < started; j++)
+        pthread_join(threads[j], NULL);
+
+    for (int j = 0; j < queue.count; j++)
+    {
+        SumJob *job = &queue.jobs[j];
+        if (job->failed)
+        {
+            printf("-myShell: sum: %s: No such file or directory\n", job->path);
+            lastStatus = 1;
+        }
+        else
+            fprintf(shellOut, "%s  %s\n", job->hex, job->path ? job->path : "-");
+    }
+    free(queue.jobs);
+}
+
+int copyVerified(const char *source, const char *destination, uint32_t *checksum)
+{
+    int in = open(source, O_RDONLY);
+    if (in < 0)
+        return -1;
+    int out = open(destination, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+    {
+        close(in);
+        return -1;
+    }
+
+    // Checksum the data on its way through, in the same pass as the copy. The bytes have
+    // to pass through user space for that, so copy_file_range is not used here.
+    char buffer[OUT_BUFF];
+    uint32_t copied = 0;
+    ssize_t n;
+    int result = 0;
+    while (result == 0 && (n = read(in, buffer, sizeof(buffer))) > 0)
+    {
+        copied = crc32c(copied, buffer, n);
+        for (ssize_t written = 0; written < n;)
+        {
+            ssize_t w = write(out, buffer + written, n - written);
+            if (w < 0)
+            {
+                result = -1;
+                break;
+            }
+            written += w;
+        }
+    }
+    if (n < 0)
+        result = -1;
+
+    // A read-back would only see the page cache; fsync makes write-back errors show instead
+    if (result == 0 && fsync(out) != 0)
+        result = -1;
+    close(in);
+    if (close(out) != 0)
+        result = -1;
+    *checksum = copied;
+    return result;
+}
+
+void pin(char **args)
+{
+    StagePlacement placement = {0};
+    int i = 1;
+    if (args[i] != NULL && isdigit((unsigned char)args[i][0]))
+    {
+        if (parseCpuList(args[i], &placement.cpus) != 0)
+        {
+            printf("-myShell: pin: %s: invalid CPU list\n", args[i]);
+            lastStatus = 1;
+            return;
+        }
+        placement.hasCpus = 1;
+        i++;
+    }
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+        {
+            placement.hasNice = 1;
+            placement.nice = atoi(args[++i]);
+        }
+        else if (strcmp(args[i], "-b") == 0)
+            placement.batch = 1;
+        else
+            break;
+    }
+    if (args[i] == NULL)
+    {
+        printf("Usage: pin [cpu-list] [-n nice] [-b] command [args...]\n");
+        lastStatus = 1;
+        return;
+    }
+
+    char **command = args + i;
+    BuiltinFunc builtin = findBuiltin(command[0]);
+    if (builtin != NULL)
+    {
+        PipeStage stage = {builtin, command, shellIn, shellOut, 0, &placement};
+        runStageHere(&stage);
+    }
+    else
+        runExternal(command, shellEnviron(), &placement);
+}
+
+void setCommand(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(shellOut, "pipepin %s\n", pipePinAuto ? "auto" : "off");
+        if (pipeSize > 0)
+            fprintf(shellOut, "pipesize %d\n", pipeSize);
+        else
+            fprintf(shellOut, "pipesize default\n");
+        return;
+    }
+    if (strcmp(args[1], "pipesize") == 0 && args[2] != NULL)
+    {
+        size_t size = strcmp(args[2], "default") == 0 ? 0 : parseSize(args[2]);
+        if (size == 0 && strcmp(args[2], "default") != 0)
+        {
+            printf("-myShell: set: %s: invalid size\n", args[2]);
+            lastStatus = 1;
+            return;
+        }
+        pipeSize = size > INT_MAX ? INT_MAX : (int)size; // The kernel rounds up to a power of two pages
+        return;
+    }
+    if (strcmp(args[1], "pipepin") == 0 && args[2] != NULL &&
+        (strcmp(args[2], "auto") == 0 || strcmp(args[2], "off") == 0))
+    {
+        pipePinAuto = strcmp(args[2], "auto") == 0;
+        return;
+    }
+    printf("Usage: set [pipepin auto|off] [pipesize SIZE|default]\n");
+    lastStatus = 1;
+}
+
+// ---- History
+//
+// One line per command in an append-only file:
+//     seconds since epoch \t exit status \t milliseconds \t cwd \t command
+// with tabs, newlines and backslashes in the cwd and command escaped. Every record goes
+// out in a single write() on an O_APPEND descriptor, so shells sharing the file never
+// interleave inside a record. Reads go through a mapping of the file, and searches
+// through a trigram index over the commands that only ever indexes the bytes the file
+// gained since the previous search.
+
+typedef struct
+{
+    uint32_t trigram; // 0 marks a free slot
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *records; // Ascending record numbers whose command holds the trigram
+} Posting;
+
+static struct
+{
+    int fd; // O_APPEND descriptor, opened with the first record
+    char *map;
+    size_t mapped;
+    size_t indexed;  // End of the last complete record seen
+    off_t *records;  // Start of each record in the file
+    size_t count;
+    size_t capacity;
+    Posting *postings; // Open addressing on the trigram
+    size_t slots;
+    size_t used;
+} history = {.fd = -1};
+
+static void historyPath(char *path, size_t size)
+{
+    const char *file = getVariable("HISTFILE");
+    const char *home = getVariable("HOME");
+    if (file != NULL && *file)
+        snprintf(path, size, "%s", file);
+    else
+        snprintf(path, size, "%s/.myshell_history", home ? home : ".");
+}
+
+static size_t escapeField(char *out, const char *text, size_t len)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = text[i];
+        if (c == '\t' || c == '\n' || c == '\\')
+        {
+            out[n++] = '\\';
+            c = c == '\t' ? 't' : c == '\n' ? 'n' : '\\';
+        }
+        out[n++] = c;
+    }
+    return n;
+}
+
+void addHistory(const char *line, int status, long milliseconds)
+{
+    const char *text = line;
+    while (isspace((unsigned char)*text))
+        text++;
+    // Scripts fed to the shell are only recorded when HISTFILE asks for it
+    if (*text == '\0' || (!isatty(STDIN_FILENO) && getVariable("HISTFILE") == NULL))
+        return;
+
+    if (history.fd < 0)
+    {
+        char path[PATH_MAX];
+        historyPath(path, sizeof(path));
+        history.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (history.fd < 0)
+            return;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        strcpy(cwd, "?");
+    size_t lineLen = strlen(line), cwdLen = strlen(cwd);
+    char *record = malloc(64 + 2 * (cwdLen + lineLen));
+    size_t n = sprintf(record, "%lld\t%d\t%ld\t", (long long)time(NULL), status, milliseconds);
+    n += escapeField(record + n, cwd, cwdLen);
+    record[n++] = '\t';
+    n += escapeField(record + n, line, lineLen);
+    record[n++] = '\n';
+    if (write(history.fd, record, n) != (ssize_t)n)
+        perror("-myShell: history");
+    free(record);
+}
+
+static uint32_t trigramAt(const char *text)
+{
+    return (1u << 24) | ((unsigned char)text[0] << 16) | ((unsigned char)text[1] << 8) | (unsigned char)text[2];
+}
+
+static Posting *findPosting(uint32_t trigram, int create)
+{
+    if (create && (history.used + 1) * 2 > history.slots)
+    {
+        // Grow and rehash
+        Posting *old = history.postings;
+        size_t oldSlots = history.slots;
+        history.slots = oldSlots ? oldSlots * 2 : 4096;
+        history.postings = calloc(history.slots, sizeof(Posting));
+        for (size_t i = 0; i < oldSlots; i++)
+        {
+            if (old[i].trigram == 0)
+                continue;
+            size_t slot = (old[i].trigram * 2654435761u) & (history.slots - 1);
+            while (history.postings[slot].trigram != 0)
+                slot = (slot + 1) & (history.slots - 1);
+            history.postings[slot] = old[i];
+        }
+        free(old);
+    }
+    if (history.slots == 0)
+        return NULL;
+    size_t slot = (trigram * 2654435761u) & (history.slots - 1);
+    while (history.postings[slot].trigram != 0 && history.postings[slot].trigram != trigram)
+        slot = (slot + 1) & (history.slots - 1);
+    if (history.postings[slot].trigram == 0)
+    {
+        if (!create)
+            return NULL;
+        history.postings[slot].trigram = trigram;
+        history.used++;
+    }
+    return &history.postings[slot];
+}
+
+// The command field of the record starting at 'start', up to its newline
+static const char *recordCommand(const char *start, const char *end, size_t *len)
+{
+    const char *field = start;
+    for (int tabs = 0; tabs < 4 && field < end; tabs++)
+    {
+        const char *tab = memchr(field, '\t', end - field);
+        field = tab ? tab + 1 : end;
+    }
+    *len = end - field;
+    return field;
+}
+
+// Maps the file again if it grew and indexes the records it gained
+static int refreshHistory(void)
+{
+    char path[PATH_MAX];
+    historyPath(path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < history.indexed)
+    {
+        // Truncated or replaced: start over
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size > history.mapped)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        if (history.map != NULL)
+            munmap(history.map, history.mapped);
+        history.map = map;
+        history.mapped = st.st_size;
+        madvise(map + history.indexed, history.mapped - history.indexed, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    const char *end = history.map + history.mapped;
+    for (const char *start = history.map + history.indexed; start < end;)
+    {
+        const char *newline = memchr(start, '\n', end - start);
+        if (newline == NULL)
+            break; // Another shell is still writing it
+        if (history.count == history.capacity)
+        {
+            history.capacity = history.capacity ? history.capacity * 2 : 1024;
+            history.records = realloc(history.records, history.capacity * sizeof(off_t));
+        }
+        uint32_t record = history.count;
+        history.records[history.count++] = start - history.map;
+
+        size_t len;
+        const char *command = recordCommand(start, newline, &len);
+        for (size_t i = 0; i + 3 <= len; i++)
+        {
+            Posting *posting = findPosting(trigramAt(command + i), 1);
+            if (posting->count > 0 && posting->records[posting->count - 1] == record)
+                continue;
+            if (posting->count == posting->capacity)
+            {
+                posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+                posting->records = realloc(posting->records, posting->capacity * sizeof(uint32_t));
+            }
+            posting->records[posting->count++] = record;
+        }
+        start = newline + 1;
+        history.indexed = start - history.map;
+    }
+    return 0;
+}
+
+static void printHistoryRecord(size_t number)
+{
+    const char *start = history.map + history.records[number];
+    const char *newline = memchr(start, '\n', history.map + history.mapped - start);
+    char *fields[5] = {NULL}, *copy = strndup(start, newline - start), *saveptr = copy;
+    for (int i = 0; i < 5; i++)
+        fields[i] = strsep(&saveptr, "\t");
+    if (fields[4] == NULL)
+    {
+        free(copy);
+        return;
+    }
+    for (int f = 3; f <= 4; f++)
+    {
+        // Undo escapeField in place
+        char *in = fields[f], *out = fields[f];
+        for (; *in; in++)
+        {
+            if (*in == '\\' && in[1])
+            {
+                in++;
+                *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+            }
+            else
+                *out++ = *in;
+        }
+        *out = '\0';
+    }
+    time_t when = (time_t)atoll(fields[0]);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    long milliseconds = atol(fields[2]);
+    fprintf(shellOut, "%6zu  %s  %3s  %4ld.%03lds  %s  %s\n", number + 1, date, fields[1],
+            milliseconds / 1000, milliseconds % 1000, fields[3], fields[4]);
+    free(copy);
+}
+
+void historyCommand(char **args)
+{
+    int search = args[1] != NULL && strcmp(args[1], "search") == 0;
+    size_t limit = (size_t)-1;
+    int i = search ? 2 : 1;
+    if (args[i] != NULL && strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+    {
+        limit = strtoul(args[i + 1], NULL, 10);
+        i += 2;
+    }
+    else if (!search && args[i] != NULL)
+        limit = strtoul(args[i++], NULL, 10);
+    if ((search && args[i] == NULL) || (!search && args[i] != NULL))
+    {
+        printf("Usage: history [N] | history search [-n N] text\n");
+        lastStatus = 1;
+        return;
+    }
+    if (refreshHistory() != 0)
+    {
+        // Nothing recorded yet, or the file was replaced: forget the old index
+        for (size_t slot = 0; slot < history.slots; slot++)
+            free(history.postings[slot].records);
+        free(history.postings);
+        free(history.records);
+        if (history.map != NULL)
+            munmap(history.map, history.mapped);
+        history = (typeof(history)){.fd = history.fd};
+        if (refreshHistory() != 0)
+            return;
+    }
+
+    if (!search)
+    {
+        for (size_t n = history.count > limit ? history.count - limit : 0; n < history.count; n++)
+            printHistoryRecord(n);
+        return;
+    }
+
+    // The search text, joined and escaped like the stored commands
+    size_t textLen = 0;
+    for (int j = i; args[j] != NULL; j++)
+        textLen += strlen(args[j]) + 1;
+    char *joined = malloc(textLen + 1), *text = malloc(2 * textLen + 1);
+    if (joined == NULL || text == NULL)
+    {
+        printf("-myShell: history: %s\n", strerror(ENOMEM));
+        lastStatus = 1;
+        free(joined);
+        free(text);
+        return;
+    }
+    size_t joinedLen = 0;
+    for (int j = i; args[j] != NULL; j++)
+    {
+        size_t len = strlen(args[j]);
+        memcpy(joined + joinedLen, args[j], len);
+        joinedLen += len;
+        if (args[j + 1] != NULL)
+            joined[joinedLen++] = ' ';
+    }
+    textLen = escapeField(text, joined, joinedLen);
+    free(joined);
+
+    // Candidates come from the rarest trigram of the text and are then checked in full;
+    // texts too short to have a trigram scan every record
+    const uint32_t *candidates = NULL;
+    size_t candidateCount = history.count;
+    for (size_t j = 0; j + 3 <= textLen; j++)
+    {
+        Posting *posting = findPosting(trigramAt(text + j), 0);
+        if (posting == NULL)
+        {
+            candidateCount = 0;
+            break;
+        }
+        if (candidates == NULL || posting->count < candidateCount)
+        {
+            candidates = posting->records;
+            candidateCount = posting->count;
+        }
+    }
+
+    // Newest first, so that a limit stops the scan early
+    size_t *matches = malloc((candidateCount + 1) * sizeof(size_t)), found = 0;
+    if (matches == NULL)
+    {
+        printf("-myShell: history: %s\n", strerror(ENOMEM));
+        lastStatus = 1;
+        free(text);
+        return;
+    }
+    for (size_t j = candidateCount; j-- > 0 && found < limit;)
+    {
+        size_t number = candidates ? candidates[j] : j;
+        const char *start = history.map + history.records[number];
+        const char *newline = memchr(start, '\n', history.map + history.mapped - start);
+        size_t len;
+        const char *command = recordCommand(start, newline, &len);
+        if (memmem(command, len, text, textLen) != NULL)
+            matches[found++] = number;
+    }
+    for (size_t j = found; j-- > 0;)
+        printHistoryRecord(matches[j]);
+    if (found == 0)
+        lastStatus = 1;
+    free(matches);
+    free(text);
+}
+
+// ---- Parallel directory walk
+//
+// Every worker owns a queue of directories still to read. It takes its own work from
+// the back, which keeps the walk depth first and the paths it builds in cache, and
+// steals from the front of the other queues when its own runs dry, which hands out the
+// oldest and usually largest subtrees. 'pending' counts directories queued or being
+// read; a child is counted before its parent is released, so it only reaches zero
+// once the whole tree is done. A worker that finds every queue empty sleeps on 'wake'
+// until a directory is queued or the walk ends.
+
+#define WALK_BUFFER (64 * 1024)
+#define WALK_MIN_THREADS 4 // Directory reads block on I/O, so even one CPU gains from a few
+
+struct linuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    char *path;
+    size_t len;
+    int depth;
+    uintptr_t tag;
+} WalkTask;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    WalkTask *tasks; // tasks[head..count) are queued
+    size_t head;
+    size_t count;
+    size_t capacity;
+} WalkQueue;
+
+typedef struct
+{
+    const char *command; // For error messages
+    WalkQueue *queues;
+    int threads;
+    unsigned int mask;
+    WalkVisit visit;
+    void *arg;
+    long pending;
+    long queued;   // Directories waiting in the queues
+    int sleepers;  // Workers waiting on 'wake'
+    pthread_mutex_t idleLock;
+    pthread_cond_t wake;
+} Walk;
+
+typedef struct
+{
+    Walk *walk;
+    int worker;
+} WalkWorker;
+
+// Wakes the sleeping workers; taking the lock orders this after a sleeper's last check
+static void walkWake(Walk *walk)
+{
+    pthread_mutex_lock(&walk->idleLock);
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->idleLock);
+}
+
+static void walkPush(Walk *walk, int worker, WalkTask task)
+{
+    WalkQueue *queue = &walk->queues[worker];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity)
+    {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->tasks = realloc(queue->tasks, queue->capacity * sizeof(WalkTask));
+    }
+    queue->tasks[queue->count++] = task;
+    pthread_mutex_unlock(&queue->lock);
+    __atomic_fetch_add(&walk->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&walk->sleepers, __ATOMIC_SEQ_CST) > 0)
+        walkWake(walk);
+}
+
+static int walkPop(Walk *walk, int worker, WalkTask *task)
+{
+    for (int i = 0; i < walk->threads; i++)
+    {
+        WalkQueue *queue = &walk->queues[(worker + i) % walk->threads];
+        pthread_mutex_lock(&queue->lock);
+        int found = queue->head < queue->count;
+        if (found)
+        {
+            *task = i == 0 ? queue->tasks[--queue->count] : queue->tasks[queue->head++];
+            if (queue->head == queue->count)
+                queue->head = queue->count = 0;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (found)
+        {
+            __atomic_fetch_sub(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void walkDirectory(Walk *walk, int worker, const WalkTask *task, char *buffer)
+{
+    int fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("-myShell: %s: %s: %s\n", walk->command, task->path, strerror(errno));
+        return;
+    }
+    char path[PATH_MAX];
+    size_t base = task->len;
+    memcpy(path, task->path, base);
+    if (path[base - 1] != '/')
+        path[base++] = '/';
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, WALK_BUFFER)) > 0)
+    {
+        for (long offset = 0; offset < n;)
+        {
+            struct linuxDirent64 *item = (struct linuxDirent64 *)(buffer + offset);
+            offset += item->d_reclen;
+            const char *name = item->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            size_t nameLen = strlen(name);
+            if (base + nameLen >= sizeof(path))
+                continue;
+            memcpy(path + base, name, nameLen + 1);
+
+            WalkEntry entry = {path, base + nameLen, path + base, item->d_type, NULL, fd, task->depth + 1, task->tag, 0};
+            struct statx stx;
+            if ((walk->mask || entry.type == DT_UNKNOWN) &&
+                statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, walk->mask | STATX_TYPE, &stx) == 0)
+            {
+                entry.stat = &stx;
+                entry.type = IFTODT(stx.stx_mode);
+            }
+            walk->visit(&entry, worker, walk->arg);
+            if (entry.type == DT_DIR && !entry.prune)
+            {
+                WalkTask child = {strndup(path, entry.pathLen), entry.pathLen, entry.depth, entry.tag};
+                __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+                walkPush(walk, worker, child);
+            }
+        }
+    }
+    if (n < 0)
+        printf("-myShell: %s: %s: %s\n", walk->command, task->path, strerror(errno));
+    close(fd);
+}
+
+static void *walkWorker(void *arg)
+{
+    WalkWorker *self = arg;
+    Walk *walk = self->walk;
+    char *buffer = malloc(WALK_BUFFER);
+    WalkTask task;
+    while (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        if (walkPop(walk, self->worker, &task))
+        {
+            walkDirectory(walk, self->worker, &task, buffer);
+            free(task.path);
+            if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL) == 0)
+                walkWake(walk); // The walk is over: release every sleeper
+            continue;
+        }
+
+        // The remaining directories are being read by others and may yield more
+        pthread_mutex_lock(&walk->idleLock);
+        __atomic_fetch_add(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) > 0)
+            pthread_cond_wait(&walk->wake, &walk->idleLock);
+        __atomic_fetch_sub(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&walk->idleLock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+int walkThreads(int requested)
+{
+    if (requested > 0)
+        return requested;
+    int cpus = onlineCpus();
+    return cpus < WALK_MIN_THREADS ? WALK_MIN_THREADS : cpus;
+}
+
+int walkTree(const char *command, const char *root, unsigned int mask, int threads, WalkVisit visit, void *arg)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(root);
+    if (len == 0 || len >= sizeof(path))
+        return -1;
+    memcpy(path, root, len + 1);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    struct statx stx;
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask | STATX_TYPE, &stx) != 0)
+    {
+        printf("-myShell: %s: %s: %s\n", command, root, strerror(errno));
+        return -1;
+    }
+    const char *slash = strrchr(path, '/');
+    WalkEntry entry = {path, len, slash && slash[1] ? slash + 1 : path, IFTODT(stx.stx_mode), &stx, AT_FDCWD, 0, 0, 0};
+    visit(&entry, 0, arg);
+    if (entry.type != DT_DIR || entry.prune)
+        return 0;
+
+    Walk walk = {command, calloc(threads, sizeof(WalkQueue)), threads, mask, visit, arg, 1};
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+    pthread_mutex_init(&walk.idleLock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+    walkPush(&walk, 0, (WalkTask){strdup(path), len, 0, entry.tag});
+
+    WalkWorker *workers = malloc(threads * sizeof(WalkWorker));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    int started = 1;
+    for (int i = 0; i < threads; i++)
+        workers[i] = (WalkWorker){&walk, i};
+    for (; started < threads; started++)
+        if (pthread_create(&ids[started], NULL, walkWorker, &workers[started]) != 0)
+            break;
+    walkWorker(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(ids[i], NULL);
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_destroy(&walk.queues[i].lock);
+        free(walk.queues[i].tasks);
+    }
+    pthread_mutex_destroy(&walk.idleLock);
+    pthread_cond_destroy(&walk.wake);
+    free(walk.queues);
+    free(workers);
+    free(ids);
+    return 0;
+}
+
+// ---- find
+
+#define FIND_INDEX_MAGIC "MSHFIND1"
+#define FIND_INDEX_BLOCK 32 // Entries per front-coded block
+
+typedef struct
+{
+    const char *name; // fnmatch pattern for the last component
+    int type;         // DT_* or -1 for any
+    int sizeTest;     // '+', '-', '=' or 0
+    uint64_t size;    // In 'sizeUnit's
+    uint64_t sizeUnit;
+    int mtimeTest;
+    long mtimeDays;
+    time_t now;
+
+    FILE *out;
+    pthread_mutex_t outLock;
+    char **buffers; // Per worker output, or the collected entries for --index
+    size_t *used;
+    size_t *capacity;
+    int collect;
+} FindQuery;
+
+static int findTypeOf(const char *text)
+{
+    return strcmp(text, "f") == 0 ? DT_REG : strcmp(text, "d") == 0 ? DT_DIR : strcmp(text, "l") == 0 ? DT_LNK : -2;
+}
+
+static char findTypeLetter(int type)
+{
+    return type == DT_REG ? 'f' : type == DT_DIR ? 'd' : type == DT_LNK ? 'l' : 'o';
+}
+
+static int findCompare(int test, uint64_t value, uint64_t wanted)
+{
+    return test == '+' ? value > wanted : test == '-' ? value < wanted : value == wanted;
+}
+
+static int findMatches(const FindQuery *query, const char *name, int type, const struct statx *stx)
+{
+    if (query->type >= 0 && type != query->type)
+        return 0;
+    if (query->name != NULL && fnmatch(query->name, name, 0) != 0)
+        return 0;
+    if (query->sizeTest && (stx == NULL ||
+                            !findCompare(query->sizeTest, (stx->stx_size + query->sizeUnit - 1) / query->sizeUnit, query->size)))
+        return 0;
+    if (query->mtimeTest)
+    {
+        if (stx == NULL)
+            return 0;
+        long days = (query->now - stx->stx_mtime.tv_sec) / 86400;
+        if (!findCompare(query->mtimeTest, days < 0 ? 0 : days, query->mtimeDays))
+            return 0;
+    }
+    return 1;
+}
+
+static void findFlush(FindQuery *query, int worker)
+{
+    pthread_mutex_lock(&query->outLock);
+    fwrite(query->buffers[worker], 1, query->used[worker], query->out);
+    pthread_mutex_unlock(&query->outLock);
+    query->used[worker] = 0;
+}
+
+static void findVisit(WalkEntry *entry, int worker, void *arg)
+{
+    FindQuery *query = arg;
+    if (query->collect)
+    {
+        // --index keeps every entry as "<type letter><path>" in one growing block per worker
+        if (query->used[worker] + entry->pathLen + 2 > query->capacity[worker])
+        {
+            query->capacity[worker] = (query->capacity[worker] + entry->pathLen + 2) * 2;
+            query->buffers[worker] = realloc(query->buffers[worker], query->capacity[worker]);
+        }
+        char *slot = query->buffers[worker] + query->used[worker];
+        slot[0] = findTypeLetter(entry->type);
+        memcpy(slot + 1, entry->path, entry->pathLen + 1);
+        query->used[worker] += entry->pathLen + 2;
+        return;
+    }
+    if (!findMatches(query, entry->name, entry->type, entry->stat))
+        return;
+    if (query->used[worker] + entry->pathLen + 1 > OUT_BUFF)
+        findFlush(query, worker);
+    memcpy(query->buffers[worker] + query->used[worker], entry->path, entry->pathLen);
+    query->buffers[worker][query->used[worker] + entry->pathLen] = '\n';
+    query->used[worker] += entry->pathLen + 1;
+}
+
+static int comparePaths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a + 1, *(char *const *)b + 1);
+}
+
+static size_t putVarint(unsigned char *out, uint64_t value)
+{
+    size_t n = 0;
+    for (; value >= 0x80; value >>= 7)
+        out[n++] = (unsigned char)value | 0x80;
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Reads a varint that must end before 'end'; returns 0 for a truncated or overlong one
+static int getVarint(const unsigned char **in, const unsigned char *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; *in < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*in)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+// Index layout: magic, entry count, block count, one file offset per block, then the
+// blocks. Each entry is varint(shared prefix), varint(suffix length), type letter and
+// suffix; the first entry of a block shares nothing so a lookup can start there.
+static int writeFindIndex(const char *file, char **entries, size_t count)
+{
+    char temp[PATH_MAX + 16];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", file);
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        return -1;
+    FILE *out = fdopen(fd, "w");
+    uint64_t blocks = (count + FIND_INDEX_BLOCK - 1) / FIND_INDEX_BLOCK;
+    uint64_t *offsets = malloc((blocks + 1) * sizeof(uint64_t));
+    if (out == NULL || offsets == NULL)
+    {
+        int error = errno;
+        if (out != NULL)
+            fclose(out);
+        else
+            close(fd);
+        unlink(temp);
+        free(offsets);
+        errno = error;
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, OUT_BUFF);
+    uint64_t header[2] = {count, blocks};
+    uint64_t position = 8 + sizeof(header) + blocks * sizeof(uint64_t);
+    fwrite(FIND_INDEX_MAGIC, 1, 8, out);
+    fwrite(header, sizeof(header), 1, out);
+    fseek(out, position, SEEK_SET);
+
+    const char *previous = "";
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *path = entries[i] + 1;
+        size_t shared = 0;
+        if (i % FIND_INDEX_BLOCK == 0)
+            offsets[i / FIND_INDEX_BLOCK] = position;
+        else
+            while (previous[shared] && previous[shared] == path[shared])
+                shared++;
+        size_t suffix = strlen(path + shared);
+        unsigned char head[21];
+        size_t headLen = putVarint(head, shared);
+        headLen += putVarint(head + headLen, suffix);
+        head[headLen++] = entries[i][0];
+        fwrite(head, 1, headLen, out);
+        fwrite(path + shared, 1, suffix, out);
+        position += headLen + suffix;
+        previous = path;
+    }
+    fseek(out, 8 + sizeof(header), SEEK_SET);
+    fwrite(offsets, sizeof(uint64_t), blocks, out);
+    free(offsets);
+    if (fclose(out) != 0 || rename(temp, file) != 0)
+    {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+static void findLookup(const char *file, const char *prefix, const FindQuery *query)
+{
+    size_t len;
+    int mapped;
+    char *data = mapInput(file, -1, &len, &mapped);
+    if (data == NULL || len < 24 || memcmp(data, FIND_INDEX_MAGIC, 8) != 0)
+    {
+        printf("-myShell: find: %s: not a find index\n", file);
+        lastStatus = 1;
+        if (data != NULL)
+            unmapInput(data, len, mapped);
+        return;
+    }
+    uint64_t count, blocks;
+    memcpy(&count, data + 8, 8);
+    memcpy(&blocks, data + 16, 8);
+    const uint64_t *offsets = (const uint64_t *)(data + 24);
+    const unsigned char *end = (const unsigned char *)data + len;
+    size_t prefixLen = strlen(prefix);
+
+    // Nothing in the file is trusted: the header must agree with itself and every block
+    // offset must point past the offset table and into the file
+    int valid = blocks == count / FIND_INDEX_BLOCK + (count % FIND_INDEX_BLOCK != 0) && blocks <= (len - 24) / 8;
+    for (uint64_t b = 0; valid && b < blocks; b++)
+        valid = offsets[b] >= 24 + blocks * 8 && offsets[b] < len;
+    if (!valid)
+    {
+        printf("-myShell: find: %s: corrupt find index\n", file);
+        lastStatus = 1;
+        unmapInput(data, len, mapped);
+        return;
+    }
+
+    // Binary search for the last block whose first path sorts before the prefix
+    uint64_t low = 0, high = blocks;
+    while (high - low > 1)
+    {
+        uint64_t middle = (low + high) / 2;
+        const unsigned char *entry = (const unsigned char *)data + offsets[middle];
+        uint64_t shared, suffix;
+        if (!getVarint(&entry, end, &shared) || !getVarint(&entry, end, &suffix) ||
+            suffix >= (uint64_t)(end - entry))
+        {
+            high = middle; // A damaged block is treated as sorting after the prefix
+            continue;
+        }
+        entry++;
+        size_t common = suffix < prefixLen ? suffix : prefixLen;
+        int order = memcmp(entry, prefix, common);
+        if (order < 0 || (order == 0 && suffix < prefixLen))
+            low = middle;
+        else
+            high = middle;
+    }
+
+    char path[PATH_MAX];
+    size_t pathLen = 0;
+    const unsigned char *entry = blocks ? (const unsigned char *)data + offsets[low] : NULL;
+    for (uint64_t i = low * FIND_INDEX_BLOCK; i < count; i++)
+    {
+        uint64_t shared, suffix;
+        if (!getVarint(&entry, end, &shared) || !getVarint(&entry, end, &suffix))
+            shared = sizeof(path); // Truncated: fails the checks below
+        if (i % FIND_INDEX_BLOCK == 0)
+            pathLen = 0; // Block starts share nothing with the last path
+        if (shared > pathLen || suffix >= (uint64_t)(end - entry) || shared + suffix >= sizeof(path))
+        {
+            printf("-myShell: find: %s: corrupt find index\n", file);
+            lastStatus = 1;
+            break;
+        }
+        char type = *entry++;
+        memcpy(path + shared, entry, suffix);
+        entry += suffix;
+        pathLen = shared + suffix;
+        path[pathLen] = '\0';
+
+        int order = strncmp(path, prefix, prefixLen);
+        if (order > 0)
+            break;
+        if (order < 0)
+            continue;
+        const char *slash = strrchr(path, '/');
+        int dtype = type == 'f' ? DT_REG : type == 'd' ? DT_DIR : type == 'l' ? DT_LNK : DT_UNKNOWN;
+        if (findMatches(query, slash && slash[1] ? slash + 1 : path, dtype, NULL))
+        {
+            path[pathLen] = '\n';
+            writeOutput(path, pathLen + 1);
+        }
+    }
+    unmapInput(data, len, mapped);
+}
+
+void findCommand(char **args)
+{
+    FindQuery query = {.type = -1, .now = time(NULL), .out = shellOut};
+    const char *indexFile = NULL, *lookupFile = NULL;
+    const char *roots[64];
+    int rootCount = 0, threads = 0, i = 1;
+
+    if (args[i] != NULL && (strcmp(args[i], "--index") == 0 || strcmp(args[i], "--lookup") == 0) && args[i + 1] != NULL)
+    {
+        *(strcmp(args[i], "--index") == 0 ? &indexFile : &lookupFile) = args[i + 1];
+        i += 2;
+    }
+    for (; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+            threads = atoi(args[++i]);
+        else if (strcmp(args[i], "-name") == 0 && args[i + 1] != NULL)
+            query.name = args[++i];
+        else if (strcmp(args[i], "-type") == 0 && args[i + 1] != NULL && (query.type = findTypeOf(args[i + 1])) != -2)
+            i++;
+        else if ((strcmp(args[i], "-size") == 0 || strcmp(args[i], "-mtime") == 0) && args[i + 1] != NULL &&
+                 lookupFile == NULL)
+        {
+            int size = args[i][1] == 's';
+            const char *value = args[++i];
+            int test = *value == '+' || *value == '-' ? *value++ : '=';
+            char *unit;
+            uint64_t number = strtoull(value, &unit, 10);
+            if (size)
+            {
+                query.sizeTest = test;
+                query.size = number;
+                query.sizeUnit = *unit ? parseSize(unit[0] == 'c' ? "1" : (char[]){'1', *unit, '\0'}) : 1;
+            }
+            else
+            {
+                query.mtimeTest = test;
+                query.mtimeDays = number;
+            }
+        }
+        else if (args[i][0] != '-' && rootCount < 64)
+            roots[rootCount++] = args[i];
+        else
+        {
+            printf("Usage: find [-j N] [path...] [-name PATTERN] [-type f|d|l] [-size [+-]N[cKMG]] [-mtime [+-]DAYS]\n"
+                   "       find --index FILE [-j N] [path...]\n"
+                   "       find --lookup FILE [prefix] [-name PATTERN] [-type f|d|l]\n");
+            lastStatus = 1;
+            return;
+        }
+    }
+
+    if (lookupFile != NULL)
+    {
+        char prefix[PATH_MAX];
+        if (rootCount == 0 || realpath(roots[0], prefix) == NULL)
+            snprintf(prefix, sizeof(prefix), "%s", rootCount ? roots[0] : "");
+        findLookup(lookupFile, prefix, &query);
+        return;
+    }
+    if (rootCount == 0)
+        roots[rootCount++] = ".";
+
+    threads = walkThreads(threads);
+    unsigned int mask = (query.sizeTest ? STATX_SIZE : 0) | (query.mtimeTest ? STATX_MTIME : 0);
+    query.collect = indexFile != NULL;
+    query.buffers = calloc(threads, sizeof(char *));
+    query.used = calloc(threads, sizeof(size_t));
+    query.capacity = calloc(threads, sizeof(size_t));
+    for (int t = 0; t < threads && !query.collect; t++)
+        query.buffers[t] = malloc(OUT_BUFF);
+    pthread_mutex_init(&query.outLock, NULL);
+
+    fflush(shellOut);
+    for (int r = 0; r < rootCount; r++)
+    {
+        char absolute[PATH_MAX];
+        const char *root = roots[r];
+        // The index holds absolute paths, so lookups work from any directory
+        if (query.collect && realpath(root, absolute) != NULL)
+            root = absolute;
+        if (walkTree("find", root, mask, threads, findVisit, &query) != 0)
+            lastStatus = 1;
+    }
+    for (int t = 0; t < threads && !query.collect; t++)
+        if (query.used[t] > 0)
+            findFlush(&query, t);
+
+    if (query.collect)
+    {
+        size_t count = 0;
+        for (int t = 0; t < threads; t++)
+            for (size_t at = 0; at < query.used[t]; at += strlen(query.buffers[t] + at) + 1)
+                count++;
+        char **entries = malloc((count + 1) * sizeof(char *));
+        count = 0;
+        for (int t = 0; t < threads; t++)
+            for (size_t at = 0; at < query.used[t]; at += strlen(query.buffers[t] + at) + 1)
+                entries[count++] = query.buffers[t] + at;
+        qsort(entries, count, sizeof(char *), comparePaths);
+        size_t unique = 0;
+        for (size_t e = 0; e < count; e++)
+            if (unique == 0 || strcmp(entries[unique - 1] + 1, entries[e] + 1) != 0)
+                entries[unique++] = entries[e];
+        if (writeFindIndex(indexFile, entries, unique) != 0)
+        {
+            printf("-myShell: find: %s: %s\n", indexFile, strerror(errno));
+            lastStatus = 1;
+        }
+        else
+            fprintf(shellOut, "indexed %zu paths\n", unique);
+        free(entries);
+    }
+
+    for (int t = 0; t < threads; t++)
+        free(query.buffers[t]);
+    free(query.buffers);
+    free(query.used);
+    free(query.capacity);
+    pthread_mutex_destroy(&query.outLock);
+}
+
+// ---- du
+
+#define DU_SHARDS 64
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino; // 0 marks a free slot
+} DuInode;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    DuInode *slots;
+    size_t capacity;
+    size_t used;
+} DuShard;
+
+typedef struct
+{
+    DuShard shards[DU_SHARDS]; // Inodes with several links seen so far, sharded to spread the locks
+    uint64_t *totals;          // totals[worker * tops + tag]: bytes per first-level entry
+    char **names;              // names[tag - 1]; tag 0 is the root itself plus any overflow
+    int tops;                  // Slots in each worker's row of totals
+    int named;
+    pthread_mutex_t nameLock;
+} DuWalk;
+
+// Returns 1 the first time an inode is seen
+static int duFirstLink(DuWalk *du, uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = (ino * 0x9E3779B97F4A7C15ull) ^ dev;
+    DuShard *shard = &du->shards[hash % DU_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->used + 1) * 2 > shard->capacity)
+    {
+        DuInode *old = shard->slots;
+        size_t oldCapacity = shard->capacity;
+        shard->capacity = oldCapacity ? oldCapacity * 2 : 256;
+        shard->slots = calloc(shard->capacity, sizeof(DuInode));
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (old[i].ino == 0)
+                continue;
+            size_t slot = ((old[i].ino * 0x9E3779B97F4A7C15ull) >> 20) & (shard->capacity - 1);
+            while (shard->slots[slot].ino != 0)
+                slot = (slot + 1) & (shard->capacity - 1);
+            shard->slots[slot] = old[i];
+        }
+        free(old);
+    }
+    size_t slot = ((ino * 0x9E3779B97F4A7C15ull) >> 20) & (shard->capacity - 1);
+    int first = 1;
+    for (; shard->slots[slot].ino != 0; slot = (slot + 1) & (shard->capacity - 1))
+    {
+        if (shard->slots[slot].ino == ino && shard->slots[slot].dev == dev)
+        {
+            first = 0;
+            break;
+        }
+    }
+    if (first)
+    {
+        shard->slots[slot] = (DuInode){dev, ino};
+        shard->used++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return first;
+}
+
+static void duVisit(WalkEntry *entry, int worker, void *arg)
+{
+    DuWalk *du = arg;
+    if (entry->depth == 1)
+    {
+        // Only the root's reader sees depth 1, but the names array is shared
+        pthread_mutex_lock(&du->nameLock);
+        if (du->named + 1 < du->tops)
+        {
+            du->names[du->named++] = strdup(entry->name);
+            entry->tag = du->named;
+        }
+        pthread_mutex_unlock(&du->nameLock);
+    }
+    const struct statx *stx = entry->stat;
+    if (stx == NULL)
+        return;
+    if (entry->type != DT_DIR && stx->stx_nlink > 1 &&
+        !duFirstLink(du, makedev(stx->stx_dev_major, stx->stx_dev_minor), stx->stx_ino))
+        return;
+    du->totals[(size_t)worker * du->tops + entry->tag] += stx->stx_blocks * 512;
+}
+
+static void formatSize(char *out, size_t size, uint64_t bytes)
+{
+    const char *units = "BKMGTP";
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && units[unit + 1])
+    {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0)
+        snprintf(out, size, "%lluB", (unsigned long long)bytes);
+    else
+        snprintf(out, size, value < 10 ? "%.1f%c" : "%.0f%c", value, units[unit]);
+}
+
+static int compareTotals(const void *a, const void *b)
+{
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void du(char **args)
+{
+    int top = 10, threads = 0;
+    const char *root = ".";
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+            top = atoi(args[++i]);
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+            threads = atoi(args[++i]);
+        else if (args[i][0] != '-')
+            root = args[i];
+        else
+        {
+            printf("Usage: du [-n N] [-j threads] [path]\n");
+            lastStatus = 1;
+            return;
+        }
+    }
+    threads = walkThreads(threads);
+
+    // Size the per-entry totals from a first look at the root, so workers never resize them
+    int entries = 0;
+    DIR *dir = opendir(root);
+    if (dir != NULL)
+    {
+        while (readdir(dir) != NULL)
+            entries++;
+        closedir(dir);
+    }
+
+    DuWalk walk = {.tops = entries + 64};
+    walk.totals = calloc((size_t)threads * walk.tops, sizeof(uint64_t));
+    walk.names = calloc(walk.tops, sizeof(char *));
+    pthread_mutex_init(&walk.nameLock, NULL);
+    for (int i = 0; i < DU_SHARDS; i++)
+        pthread_mutex_init(&walk.shards[i].lock, NULL);
+
+    if (walkTree("du", root, STATX_BLOCKS | STATX_INO | STATX_NLINK, threads, duVisit, &walk) != 0)
+        lastStatus = 1;
+    else
+    {
+        // Rows of {bytes, tag}, largest first
+        uint64_t (*rows)[2] = calloc(walk.named + 1, sizeof(*rows));
+        uint64_t total = 0;
+        for (int tag = 0; tag <= walk.named; tag++)
+        {
+            rows[tag][1] = tag;
+            for (int t = 0; t < threads; t++)
+                rows[tag][0] += walk.totals[(size_t)t * walk.tops + tag];
+            total += rows[tag][0];
+        }
+        qsort(rows + 1, walk.named, sizeof(*rows), compareTotals);
+        char size[32];
+        for (int i = 1; i <= walk.named && i <= top; i++)
+        {
+            formatSize(size, sizeof(size), rows[i][0]);
+            fprintf(shellOut, "%8s  %s/%s\n", size, root, walk.names[rows[i][1] - 1]);
+        }
+        formatSize(size, sizeof(size), total);
+        fprintf(shellOut, "%8s  %s\n", size, root);
+        free(rows);
+    }
+
+    for (int i = 0; i < walk.named; i++)
+        free(walk.names[i]);
+    for (int i = 0; i < DU_SHARDS; i++)
+    {
+        pthread_mutex_destroy(&walk.shards[i].lock);
+        free(walk.shards[i].slots);
+    }
+    free(walk.names);
+    free(walk.totals);
+    pthread_mutex_destroy(&walk.nameLock);
+}
+
+// ---- Runtime statistics
+//
+// Every thread that counts something gets a block of its own, found through a __thread
+// pointer, and is the only writer of it: a bump is a plain load and store, with no
+// lock prefix and no shared cache line. Readers add up the blocks under 'statsLock',
+// which also guards the list. A thread's block is folded into 'retiredStats' when the
+// thread exits.
+
+#define STATS_BUCKETS 32 // Bucket i holds durations below 2^i microseconds
+
+typedef struct StatsBlock
+{
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t buckets[STAT_HISTOGRAMS][STATS_BUCKETS];
+    uint64_t sums[STAT_HISTOGRAMS]; // Microseconds
+    struct StatsBlock *next;
+} StatsBlock;
+
+static __thread StatsBlock *threadStats;
+static StatsBlock *statsBlocks;
+static StatsBlock retiredStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t statsKey;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+
+static const char *const counterNames[STAT_COUNTERS] = {
+    "myshell_commands_total{kind=\"builtin\"}",
+    "myshell_commands_total{kind=\"external\"}",
+    "myshell_pipelines_total",
+    "myshell_pipeline_stages_total",
+    "myshell_processes_started_total",
+    "myshell_bytes_total{op=\"cp\"}",
+    "myshell_bytes_total{op=\"rd\"}",
+    "myshell_bytes_total{op=\"move\"}",
+};
+
+static const char *const histogramNames[STAT_HISTOGRAMS] = {
+    "myshell_fork_exec_seconds",
+    "myshell_line_seconds",
+};
+
+static void statsMerge(StatsBlock *into, const StatsBlock *from)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        into->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+    for (int h = 0; h < STAT_HISTOGRAMS; h++)
+    {
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            into->buckets[h][b] += __atomic_load_n(&from->buckets[h][b], __ATOMIC_RELAXED);
+        into->sums[h] += __atomic_load_n(&from->sums[h], __ATOMIC_RELAXED);
+    }
+}
+
+static void statsRetire(void *arg)
+{
+    StatsBlock *block = arg;
+    pthread_mutex_lock(&statsLock);
+    statsMerge(&retiredStats, block);
+    for (StatsBlock **link = &statsBlocks; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == block)
+        {
+            *link = block->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
+    free(block);
+}
+
+static void statsCreateKey(void)
+{
+    pthread_key_create(&statsKey, statsRetire);
+}
+
+static StatsBlock *statsRegister(void)
+{
+    pthread_once(&statsOnce, statsCreateKey);
+    StatsBlock *block = calloc(1, sizeof(StatsBlock));
+    if (block == NULL)
+        return NULL;
+    pthread_mutex_lock(&statsLock);
+    block->next = statsBlocks;
+    statsBlocks = block;
+    pthread_mutex_unlock(&statsLock);
+    pthread_setspecific(statsKey, block);
+    threadStats = block;
+    return block;
+}
+
+static inline void statsBump(uint64_t *value, uint64_t n)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void statsAdd(int counter, uint64_t n)
+{
+    StatsBlock *block = threadStats ? threadStats : statsRegister();
+    if (block != NULL)
+        statsBump(&block->counters[counter], n);
+}
+
+void statsRecord(int histogram, uint64_t microseconds)
+{
+    StatsBlock *block = threadStats ? threadStats : statsRegister();
+    if (block == NULL)
+        return;
+    int bucket = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+    statsBump(&block->buckets[histogram][bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+    statsBump(&block->sums[histogram], microseconds);
+}
+
+static void statsSnapshot(StatsBlock *total)
+{
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&statsLock);
+    statsMerge(total, &retiredStats);
+    for (StatsBlock *block = statsBlocks; block != NULL; block = block->next)
+        statsMerge(total, block);
+    pthread_mutex_unlock(&statsLock);
+}
+
+static void statsWritePrometheus(FILE *out)
+{
+    StatsBlock total;
+    statsSnapshot(&total);
+    const char *previous = "";
+    for (int i = 0; i < STAT_COUNTERS; i++)
+    {
+        size_t family = strcspn(counterNames[i], "{");
+        if (strncmp(previous, counterNames[i], family) != 0)
+            fprintf(out, "# TYPE %.*s counter\n", (int)family, counterNames[i]);
+        fprintf(out, "%s %llu\n", counterNames[i], (unsigned long long)total.counters[i]);
+        previous = counterNames[i];
+    }
+    for (int h = 0; h < STAT_HISTOGRAMS; h++)
+    {
+        uint64_t cumulative = 0;
+        fprintf(out, "# TYPE %s histogram\n", histogramNames[h]);
+        for (int b = 0; b < STATS_BUCKETS - 1; b++)
+        {
+            cumulative += total.buckets[h][b];
+            fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", histogramNames[h], (double)(1ull << b) / 1e6,
+                    (unsigned long long)cumulative);
+        }
+        cumulative += total.buckets[h][STATS_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", histogramNames[h], (unsigned long long)cumulative);
+        fprintf(out, "%s_sum %g\n", histogramNames[h], total.sums[h] / 1e6);
+        fprintf(out, "%s_count %llu\n", histogramNames[h], (unsigned long long)cumulative);
+    }
+    // Heap gauges stand in for allocation counts, which would need a malloc wrapper
+    struct mallinfo2 heap = mallinfo2();
+    fprintf(out, "# TYPE myshell_heap_bytes gauge\n");
+    fprintf(out, "myshell_heap_bytes{kind=\"in_use\"} %zu\n", heap.uordblks + heap.hblkhd);
+    fprintf(out, "myshell_heap_bytes{kind=\"free\"} %zu\n", heap.fordblks);
+    fprintf(out, "myshell_heap_bytes{kind=\"mmapped\"} %zu\n", heap.hblkhd);
+    fprintf(out, "# TYPE myshell_heap_mmapped_blocks gauge\n");
+    fprintf(out, "myshell_heap_mmapped_blocks %zu\n", heap.hblks);
+}
+
+// The bucket bound below which 'fraction' of the samples fall
+static uint64_t statsQuantile(const uint64_t *buckets, uint64_t count, double fraction)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > 0 && seen >= fraction * count)
+            return 1ull << b;
+    }
+    return 1ull << (STATS_BUCKETS - 1);
+}
+
+static void statsWriteText(FILE *out)
+{
+    StatsBlock total;
+    statsSnapshot(&total);
+    const uint64_t *c = total.counters;
+    char cp[32], rd[32], move[32];
+    formatSize(cp, sizeof(cp), c[STAT_BYTES_CP]);
+    formatSize(rd, sizeof(rd), c[STAT_BYTES_RD]);
+    formatSize(move, sizeof(move), c[STAT_BYTES_MOVE]);
+    fprintf(out, "commands     %llu builtin, %llu external\n", (unsigned long long)c[STAT_COMMANDS_BUILTIN],
+            (unsigned long long)c[STAT_COMMANDS_EXTERNAL]);
+    fprintf(out, "pipelines    %llu (%llu stages)\n", (unsigned long long)c[STAT_PIPELINES],
+            (unsigned long long)c[STAT_PIPELINE_STAGES]);
+    fprintf(out, "processes    %llu started\n", (unsigned long long)c[STAT_FORKS]);
+    fprintf(out, "bytes        cp %s, rd %s, move %s\n", cp, rd, move);
+    const char *labels[STAT_HISTOGRAMS] = {"fork+exec", "line"};
+    for (int h = 0; h < STAT_HISTOGRAMS; h++)
+    {
+        uint64_t count = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            count += total.buckets[h][b];
+        fprintf(out, "%-12s %llu", labels[h], (unsigned long long)count);
+        if (count > 0)
+            fprintf(out, ", mean %lluus, p50 <%lluus, p99 <%lluus", (unsigned long long)(total.sums[h] / count),
+                    (unsigned long long)statsQuantile(total.buckets[h], count, 0.5),
+                    (unsigned long long)statsQuantile(total.buckets[h], count, 0.99));
+        fputc('\n', out);
+    }
+    struct mallinfo2 heap = mallinfo2();
+    char inUse[32], mmapped[32], freeBytes[32];
+    formatSize(inUse, sizeof(inUse), heap.uordblks + heap.hblkhd);
+    formatSize(mmapped, sizeof(mmapped), heap.hblkhd);
+    formatSize(freeBytes, sizeof(freeBytes), heap.fordblks);
+    fprintf(out, "heap         %s in use (%s in %zu mmapped blocks), %s free\n", inUse, mmapped, heap.hblks, freeBytes);
+}
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    pthread_t thread;
+    int running;
+    char *path;
+    int seconds;
+} statsDump = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void statsDumpOnce(const char *path)
+{
+    // Write beside the file and rename, so a scraper never reads half a dump
+    char temp[PATH_MAX + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *out = fopen(temp, "w");
+    if (out == NULL)
+        return;
+    statsWritePrometheus(out);
+    if (fclose(out) == 0)
+        rename(temp, path);
+}
+
+static void *statsDumpLoop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&statsDump.lock);
+    while (statsDump.running)
+    {
+        statsDumpOnce(statsDump.path);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += statsDump.seconds;
+        while (statsDump.running && pthread_cond_timedwait(&statsDump.stop, &statsDump.lock, &until) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&statsDump.lock);
+    return NULL;
+}
+
+static void statsStopDump(void)
+{
+    pthread_mutex_lock(&statsDump.lock);
+    int running = statsDump.running;
+    statsDump.running = 0;
+    pthread_cond_signal(&statsDump.stop);
+    pthread_mutex_unlock(&statsDump.lock);
+    if (running)
+    {
+        pthread_join(statsDump.thread, NULL);
+        free(statsDump.path);
+        statsDump.path = NULL;
+    }
+}
+
+void stats(char **args)
+{
+    if (args[1] == NULL)
+        statsWriteText(shellOut);
+    else if (strcmp(args[1], "prom") == 0)
+        statsWritePrometheus(shellOut);
+    else if (strcmp(args[1], "dump") == 0 && args[2] != NULL && strcmp(args[2], "off") == 0)
+        statsStopDump();
+    else if (strcmp(args[1], "dump") == 0 && args[2] != NULL)
+    {
+        int seconds = args[3] ? atoi(args[3]) : 15;
+        statsStopDump();
+        statsDump.path = strdup(args[2]);
+        statsDump.seconds = seconds > 0 ? seconds : 15;
+        statsDump.running = 1;
+        if (pthread_create(&statsDump.thread, NULL, statsDumpLoop, NULL) != 0)
+        {
+            perror("-myShell: stats");
+            statsDump.running = 0;
+            free(statsDump.path);
+            statsDump.path = NULL;
+            lastStatus = 1;
+        }
+    }
+    else
+    {
+        printf("Usage: stats [prom | dump FILE [SECONDS] | dump off]\n");
+        lastStatus = 1;
+    }
+}
+
+// ---- cmp
+
+#define CMP_CHUNK (16 * 1024 * 1024)         // Work unit of a parallel comparison
+#define CMP_PARALLEL_MIN (64 * 1024 * 1024) // Smaller files are compared on one thread
+
+// Each kernel returns the offset of the first differing byte, or 'len'
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static size_t firstDifferenceAvx2(const unsigned char *a, const unsigned char *b,
+                                                                  size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y0 = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(a + i + 32));
+        __m256i y1 = _mm256_loadu_si256((const __m256i *)(b + i + 32));
+        __m256i same = _mm256_and_si256(_mm256_cmpeq_epi8(x0, y0), _mm256_cmpeq_epi8(x1, y1));
+        if ((uint32_t)_mm256_movemask_epi8(same) != 0xFFFFFFFFu)
+        {
+            uint32_t low = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+            if (low != 0)
+                return i + __builtin_ctz(low);
+            return i + 32 + __builtin_ctz(~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1)));
+        }
+    }
+    for (; i < len && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+// SSE2 is part of x86-64, so this needs no check
+static size_t firstDifferenceSse2(const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+                                     _mm_loadu_si128((const __m128i *)(b + i + 16)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(eq0) | ((uint32_t)_mm_movemask_epi8(eq1) << 16);
+        if (mask != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~mask);
+    }
+    for (; i < len && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+#else
+static size_t firstDifferencePortable(const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            break; // The byte loop below finds which one
+    }
+    for (; i < len && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+#endif
+
+static size_t firstDifference(const unsigned char *a, const unsigned char *b, size_t len)
+{
+#if defined(__x86_64__)
+    static int avx2 = -1;
+    if (avx2 < 0)
+        avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? firstDifferenceAvx2(a, b, len) : firstDifferenceSse2(a, b, len);
+#else
+    return firstDifferencePortable(a, b, len);
+#endif
+}
+
+typedef struct
+{
+    const unsigned char *a;
+    const unsigned char *b;
+    size_t len;
+    size_t next;  // Next unclaimed chunk, advanced atomically
+    size_t first; // Lowest difference found so far, lowered atomically
+} CmpQueue;
+
+static void *cmpWorker(void *arg)
+{
+    CmpQueue *queue = arg;
+    size_t chunks = (queue->len + CMP_CHUNK - 1) / CMP_CHUNK, index;
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < chunks)
+    {
+        size_t start = index * CMP_CHUNK;
+        // Chunks are claimed in order, so once one starts past a difference all later do
+        if (start >= __atomic_load_n(&queue->first, __ATOMIC_RELAXED))
+            break;
+        size_t len = queue->len - start < CMP_CHUNK ? queue->len - start : CMP_CHUNK;
+        size_t found = start + firstDifference(queue->a + start, queue->b + start, len);
+        if (found == start + len)
+            continue;
+        size_t current = __atomic_load_n(&queue->first, __ATOMIC_RELAXED);
+        while (found < current &&
+               !__atomic_compare_exchange_n(&queue->first, &current, found, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    return NULL;
+}
+
+static size_t compareBuffers(const unsigned char *a, const unsigned char *b, size_t len)
+{
+    int workers = len < CMP_PARALLEL_MIN ? 1 : onlineCpus();
+    CmpQueue queue = {a, b, len, 0, len};
+    pthread_t threads[workers];
+    int started = 0;
+    for (; started < workers - 1; started++)
+        if (pthread_create(&threads[started], NULL, cmpWorker, &queue) != 0)
+            break;
+    cmpWorker(&queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return queue.first;
+}
+
+void cmp(char **args)
+{
+    int quiet = args[1] != NULL && strcmp(args[1], "-s") == 0;
+    char **names = args + 1 + quiet;
+    if (names[0] == NULL || names[1] == NULL || names[2] != NULL)
+    {
+        printf("Usage: cmp [-s] file1 file2\n");
+        lastStatus = 2;
+        return;
+    }
+
+    // Different sizes already decide the quiet answer, without reading either file
+    struct stat st[2];
+    int regular = 1;
+    for (int i = 0; i < 2; i++)
+    {
+        if (strcmp(names[i], "-") != 0 && stat(names[i], &st[i]) != 0)
+        {
+            printf("-myShell: cmp: %s: %s\n", names[i], strerror(errno));
+            lastStatus = 2;
+            return;
+        }
+        regular &= strcmp(names[i], "-") != 0 && S_ISREG(st[i].st_mode);
+    }
+    if (quiet && regular && st[0].st_size != st[1].st_size)
+    {
+        lastStatus = 1;
+        return;
+    }
+
+    size_t len[2];
+    int mapped[2];
+    char *data[2];
+    for (int i = 0; i < 2; i++)
+    {
+        const char *path = strcmp(names[i], "-") == 0 ? NULL : names[i];
+        data[i] = mapInput(path, fileno(shellIn), &len[i], &mapped[i]);
+        if (data[i] == NULL)
+        {
+            printf("-myShell: cmp: %s: %s\n", names[i], strerror(errno));
+            lastStatus = 2;
+            if (i == 1)
+                unmapInput(data[0], len[0], mapped[0]);
+            return;
+        }
+    }
+
+    size_t common = len[0] < len[1] ? len[0] : len[1];
+    size_t offset = compareBuffers((const unsigned char *)data[0], (const unsigned char *)data[1], common);
+    lastStatus = offset < common || len[0] != len[1];
+    if (!quiet && lastStatus)
+    {
+        size_t line = 1;
+        for (const char *p = data[0], *end = data[0] + offset; (p = memchr(p, '\n', end - p)) != NULL; p++)
+            line++;
+        if (offset < common)
+            fprintf(shellOut, "%s %s differ: byte %zu, line %zu\n", names[0], names[1], offset + 1, line);
+        else if (common > 0 && data[0][common - 1] == '\n')
+            fprintf(shellOut, "cmp: EOF on %s after byte %zu, line %zu\n", names[len[0] > len[1]], common, line - 1);
+        else
+            fprintf(shellOut, "cmp: EOF on %s after byte %zu, in line %zu\n", names[len[0] > len[1]], common, line);
+    }
+    for (int i = 0; i < 2; i++)
+        unmapInput(data[i], len[i], mapped[i]);
+}
+
+// ---- count
+
+#define COUNT_BLOCK (16 * 1024 * 1024) // Bytes of standard input counted per round
+#define COUNT_SLICE_MIN (1024 * 1024)  // Smaller slices are not worth a thread
+
+typedef struct
+{
+    uint64_t hash;
+    const char *key; // Interned in the table's arena
+    size_t keyLen;
+    uint64_t count;
+} CountEntry;
+
+// Open addressing with linear probing, one table per thread
+typedef struct
+{
+    CountEntry *slots;
+    size_t mask, used;
+    Arena keys;
+    int failed; // An allocation failed, so the counts are incomplete
+} CountTable;
+
+typedef struct
+{
+    int field; // 1-based key field, 0 for the whole line
+    int delim; // Field separator, or -1 for runs of blanks
+} CountOptions;
+
+typedef struct
+{
+    CountTable *table;
+    const CountOptions *opts;
+    const char *data;
+    size_t len;
+} CountSlice;
+
+static int countGrow(CountTable *table)
+{
+    size_t size = table->slots ? (table->mask + 1) * 2 : 1024;
+    CountEntry *slots = calloc(size, sizeof(CountEntry));
+    if (slots == NULL)
+        return -1;
+    for (size_t i = 0; table->slots != NULL && i <= table->mask; i++)
+    {
+        if (table->slots[i].key == NULL)
+            continue;
+        size_t slot = table->slots[i].hash & (size - 1);
+        while (slots[slot].key != NULL)
+            slot = (slot + 1) & (size - 1);
+        slots[slot] = table->slots[i];
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->mask = size - 1;
+    return 0;
+}
+
+// Adds 'count' to a key; 'intern' copies a new key into the table's arena, otherwise the
+// caller's key must outlive the table. A failed allocation sets table->failed.
+static void countAdd(CountTable *table, const char *key, size_t keyLen, uint64_t hash, uint64_t count, int intern)
+{
+    if (((table->used + 1) * 4 > (table->mask + 1) * 3 || table->slots == NULL) && countGrow(table) != 0)
+    {
+        table->failed = 1;
+        return;
+    }
+    size_t slot = hash & table->mask;
+    for (CountEntry *entry; (entry = &table->slots[slot])->key != NULL; slot = (slot + 1) & table->mask)
+    {
+        if (entry->hash == hash && entry->keyLen == keyLen && memcmp(entry->key, key, keyLen) == 0)
+        {
+            entry->count += count;
+            return;
+        }
+    }
+    if (intern)
+    {
+        char *copy = arenaAlloc(&table->keys, keyLen + 1);
+        if (copy == NULL)
+        {
+            table->failed = 1;
+            return;
+        }
+        memcpy(copy, key, keyLen);
+        key = copy;
+    }
+    table->slots[slot] = (CountEntry){hash, key, keyLen, count};
+    table->used++;
+}
+
+static void countLine(CountTable *table, const CountOptions *opts, const char *line, size_t len)
+{
+    const char *p = line, *end = line + len;
+    if (opts->field > 0 && opts->delim >= 0)
+    {
+        for (int field = 1; field < opts->field && p != NULL; field++)
+            if ((p = memchr(p, opts->delim, end - p)) != NULL)
+                p++;
+        if (p == NULL)
+            p = end;
+        const char *stop = memchr(p, opts->delim, end - p);
+        end = stop ? stop : end;
+    }
+    else if (opts->field > 0)
+    {
+        for (int field = 1; field <= opts->field; field++)
+        {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            line = p;
+            while (p < end && *p != ' ' && *p != '\t')
+                p++;
+        }
+        end = p;
+        p = line;
+    }
+    countAdd(table, p, end - p, hashBytes(p, end - p), 1, 1);
+}
+
+static void *countWorker(void *arg)
+{
+    CountSlice *slice = arg;
+    const char *p = slice->data, *end = slice->data + slice->len;
+    while (p < end && !slice->table->failed)
+    {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *stop = newline ? newline : end;
+        countLine(slice->table, slice->opts, p, stop - p);
+        p = stop + 1;
+    }
+    return NULL;
+}
+
+// Counts the complete lines of 'data' with one thread per table, each taking a
+// line-aligned slice
+static void countSlices(CountTable *tables, int threads, const CountOptions *opts, const char *data, size_t len)
+{
+    if (len / threads < COUNT_SLICE_MIN)
+        threads = len / COUNT_SLICE_MIN > 0 ? len / COUNT_SLICE_MIN : 1;
+    CountSlice slices[threads];
+    pthread_t ids[threads];
+    int started[threads];
+    const char *p = data, *end = data + len;
+    for (int i = 0; i < threads; i++)
+    {
+        const char *stop = i == threads - 1 ? end : p + (end - p) / (threads - i);
+        const char *newline = stop < end ? memchr(stop, '\n', end - stop) : NULL;
+        stop = newline ? newline + 1 : end;
+        slices[i] = (CountSlice){&tables[i], opts, p, stop - p};
+        p = stop;
+    }
+    for (int i = 1; i < threads; i++)
+        started[i] = pthread_create(&ids[i], NULL, countWorker, &slices[i]) == 0;
+    countWorker(&slices[0]);
+    for (int i = 1; i < threads; i++)
+    {
+        if (started[i])
+            pthread_join(ids[i], NULL);
+        else
+            countWorker(&slices[i]);
+    }
+}
+
+// Orders entries by falling count, then by key
+static int countBefore(const CountEntry *a, const CountEntry *b)
+{
+    if (a->count != b->count)
+        return a->count > b->count;
+    size_t len = a->keyLen < b->keyLen ? a->keyLen : b->keyLen;
+    int order = memcmp(a->key, b->key, len);
+    return order != 0 ? order < 0 : a->keyLen < b->keyLen;
+}
+
+// Restores a heap whose root is the entry ordered last, starting at 'i'
+static void countSift(CountEntry **heap, size_t size, size_t i)
+{
+    while (1)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= size)
+            return;
+        if (child + 1 < size && countBefore(heap[child], heap[child + 1]))
+            child++;
+        if (!countBefore(heap[i], heap[child]))
+            return;
+        CountEntry *swap = heap[i];
+        heap[i] = heap[child];
+        heap[child] = swap;
+        i = child;
+    }
+}
+
+// Keeps the first 'top' entries in a heap of that size, then sorts only those by
+// popping the heap from the back
+static size_t countTop(const CountTable *table, CountEntry **heap, size_t top)
+{
+    size_t size = 0;
+    for (size_t i = 0; table->slots != NULL && i <= table->mask; i++)
+    {
+        CountEntry *entry = &table->slots[i];
+        if (entry->key == NULL)
+            continue;
+        if (size < top)
+        {
+            heap[size++] = entry;
+            if (size == top)
+                for (size_t j = size / 2; j-- > 0;)
+                    countSift(heap, size, j);
+        }
+        else if (countBefore(entry, heap[0]))
+        {
+            heap[0] = entry;
+            countSift(heap, size, 0);
+        }
+    }
+    if (size < top)
+        for (size_t j = size / 2; j-- > 0;)
+            countSift(heap, size, j);
+    for (size_t end = size; end > 1; end--)
+    {
+        CountEntry *last = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = last;
+        countSift(heap, end - 1, 0);
+    }
+    return size;
+}
+
+static void countFree(CountTable *table)
+{
+    free(table->slots);
+    for (ArenaBlock *block = table->keys.first, *next; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+}
+
+void count(char **args)
+{
+    CountOptions opts = {0, -1};
+    int top = 10, threads = 1;
+    const char *path = NULL;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-k") == 0 && args[i + 1] != NULL)
+            opts.field = atoi(args[++i]);
+        else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL && args[i + 1][0] != '\0')
+            opts.delim = (unsigned char)args[++i][0];
+        else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+            top = atoi(args[++i]);
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+            threads = atoi(args[++i]);
+        else if (args[i][0] != '-' || strcmp(args[i], "-") == 0)
+            path = args[i];
+        else
+        {
+            printf("Usage: count [-k field] [-d delim] [-n N] [-j threads] [file]\n");
+            lastStatus = 1;
+            return;
+        }
+    }
+    if (threads < 1)
+        threads = onlineCpus();
+    if (opts.field < 0)
+        opts.field = 0;
+    if (opts.field == 0 && opts.delim >= 0)
+        opts.field = 1;
+
+    CountTable *tables = calloc(threads, sizeof(CountTable));
+    if (tables == NULL)
+    {
+        printf("-myShell: count: %s\n", strerror(ENOMEM));
+        lastStatus = 1;
+        return;
+    }
+    int failed = 0;
+    if (path != NULL && strcmp(path, "-") != 0)
+    {
+        size_t len;
+        int mapped;
+        char *data = mapInput(path, -1, &len, &mapped);
+        if (data == NULL)
+        {
+            printf("-myShell: count: %s: %s\n", path, strerror(errno));
+            lastStatus = 1;
+            free(tables);
+            return;
+        }
+        countSlices(tables, threads, &opts, data, len);
+        unmapInput(data, len, mapped); // Keys were interned, nothing points into the mapping
+    }
+    else
+    {
+        // Standard input is read in large blocks; each round counts the complete lines
+        // and carries the unfinished one over to the next
+        int fd = fileno(shellIn);
+        size_t cap = threads > 1 ? COUNT_BLOCK : OUT_BUFF * 16, len = 0;
+        char *block = malloc(cap);
+        failed = block == NULL;
+        ssize_t n;
+        while (!failed && ((n = read(fd, block + len, cap - len)) > 0 || len > 0))
+        {
+            len += n > 0 ? n : 0;
+            char *last = n > 0 ? memrchr(block, '\n', len) : block + len - 1;
+            if (last == NULL)
+            {
+                if (len == cap)
+                {
+                    // A line longer than the block
+                    char *grown = realloc(block, cap * 2);
+                    if (grown == NULL)
+                        failed = 1;
+                    else
+                    {
+                        block = grown;
+                        cap *= 2;
+                    }
+                }
+                continue;
+            }
+            countSlices(tables, threads, &opts, block, last + 1 - block);
+            for (int t = 0; t < threads; t++)
+                failed |= tables[t].failed;
+            len -= last + 1 - block;
+            memmove(block, last + 1, len);
+        }
+        free(block);
+    }
+
+    for (int t = 0; t < threads; t++)
+        failed |= tables[t].failed;
+
+    // Keys of the merged tables stay in their own arenas until the end
+    for (int t = 1; t < threads && !failed; t++)
+    {
+        for (size_t i = 0; tables[t].slots != NULL && i <= tables[t].mask; i++)
+        {
+            CountEntry *entry = &tables[t].slots[i];
+            if (entry->key != NULL)
+                countAdd(&tables[0], entry->key, entry->keyLen, entry->hash, entry->count, 0);
+        }
+    }
+
+    size_t wanted = top > 0 && (size_t)top < tables[0].used ? (size_t)top : tables[0].used;
+    CountEntry **heap = NULL;
+    if (!failed && !tables[0].failed)
+        heap = malloc((wanted + 1) * sizeof(CountEntry *));
+    if (heap == NULL)
+    {
+        printf("-myShell: count: %s\n", strerror(ENOMEM));
+        lastStatus = 1;
+    }
+    else
+    {
+        size_t rows = countTop(&tables[0], heap, wanted);
+        for (size_t i = 0; i < rows; i++)
+            fprintf(shellOut, "%7llu %.*s\n", (unsigned long long)heap[i]->count, (int)heap[i]->keyLen, heap[i]->key);
+        free(heap);
+    }
+    for (int t = 0; t < threads; t++)
+        countFree(&tables[t]);
+    free(tables);
+}
+
+// ---- split
+
+typedef struct
+{
+    int in;
+    const off_t *bounds; // Part i is [bounds[i], bounds[i + 1])
+    size_t parts;
+    const char *prefix;
+    int width;   // Letters in each suffix
+    size_t next; // Next unclaimed part, advanced atomically
+    int failed;
+} SplitQueue;
+
+// Names part 'index' prefix + "aa", "ab", ... with 'width' letters
+static void splitName(char *name, size_t size, const char *prefix, int width, size_t index)
+{
+    int len = snprintf(name, size, "%s", prefix);
+    if (len < 0 || (size_t)(len + width) >= size)
+    {
+        name[0] = '\0';
+        return;
+    }
+    for (int i = width - 1; i >= 0; i--, index /= 26)
+        name[len + i] = 'a' + index % 26;
+    name[len + width] = '\0';
+}
+
+static void *splitWorker(void *arg)
+{
+    SplitQueue *queue = arg;
+    size_t part;
+    char name[PATH_MAX];
+    while ((part = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->parts)
+    {
+        splitName(name, sizeof(name), queue->prefix, queue->width, part);
+        int out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        off_t start = queue->bounds[part];
+        int failed = out < 0 || copyRange(queue->in, start, out, 0, queue->bounds[part + 1] - start) != 0;
+        if (out >= 0)
+        {
+            int error = errno;
+            if (close(out) != 0 && !failed)
+                failed = 1;
+            else
+                errno = error;
+        }
+        if (failed)
+        {
+            printf("-myShell: split: %s: %s\n", name, strerror(errno));
+            __atomic_store_n(&queue->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Standard input cannot be copied by offset, so it is cut while it is read
+static int splitStream(int in, int byBytes, uint64_t size, const char *prefix)
+{
+    char buffer[OUT_BUFF * 16];
+    char name[PATH_MAX];
+    size_t part = 0;
+    uint64_t filled = 0; // Bytes or lines in the current part
+    int out = -1;
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer, *end = buffer + n; p < end;)
+        {
+            if (out < 0)
+            {
+                if (part == 26 * 26)
+                {
+                    printf("-myShell: split: output file suffixes exhausted\n");
+                    return -1;
+                }
+                splitName(name, sizeof(name), prefix, 2, part++);
+                if ((out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+                {
+                    printf("-myShell: split: %s: %s\n", name, strerror(errno));
+                    return -1;
+                }
+                filled = 0;
+            }
+            char *stop = end;
+            if (byBytes)
+                stop = (uint64_t)(end - p) > size - filled ? p + (size - filled) : end;
+            else
+            {
+                // Stop after the newline that completes the part, if it is in this block
+                for (char *line = p; filled < size && (line = memchr(line, '\n', end - line)) != NULL;)
+                    if (++filled == size)
+                        stop = ++line;
+                    else
+                        line++;
+            }
+            for (char *w = p; w < stop;)
+            {
+                ssize_t written = write(out, w, stop - w);
+                if (written < 0)
+                {
+                    printf("-myShell: split: %s: %s\n", name, strerror(errno));
+                    close(out);
+                    return -1;
+                }
+                w += written;
+            }
+            if (byBytes)
+                filled += stop - p;
+            if (filled == size)
+            {
+                close(out);
+                out = -1;
+            }
+            p = stop;
+        }
+    }
+    if (out >= 0)
+        close(out);
+    return n < 0 ? -1 : 0;
+}
+
+void split(char **args)
+{
+    char mode = 'l';
+    uint64_t size = 1000;
+    int threads = 0;
+    const char *path = NULL, *prefix = NULL;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if ((strcmp(args[i], "-b") == 0 || strcmp(args[i], "-l") == 0 || strcmp(args[i], "-n") == 0) &&
+            args[i + 1] != NULL)
+        {
+            mode = args[i][1];
+            size = mode == 'b' ? parseSize(args[++i]) : strtoull(args[++i], NULL, 10);
+        }
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+            threads = atoi(args[++i]);
+        else if ((args[i][0] != '-' || strcmp(args[i], "-") == 0) && path == NULL)
+            path = args[i];
+        else if (args[i][0] != '-' && path != NULL && prefix == NULL)
+            prefix = args[i];
+        else
+        {
+            size = 0;
+            break;
+        }
+    }
+    if (prefix == NULL)
+        prefix = "x";
+    if (size == 0)
+    {
+        printf("Usage: split [-b SIZE | -l LINES | -n PARTS] [-j threads] [file] [prefix]\n");
+        lastStatus = 1;
+        return;
+    }
+
+    int in = path == NULL || strcmp(path, "-") == 0 ? fileno(shellIn) : open(path, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0)
+    {
+        printf("-myShell: split: %s: %s\n", path, strerror(errno));
+        lastStatus = 1;
+        return;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        if (mode == 'n')
+            printf("-myShell: split: -n needs a regular file\n");
+        else if (splitStream(in, mode == 'b', size, prefix) == 0)
+            return;
+        lastStatus = 1;
+        return;
+    }
+
+    // Boundaries are worked out first, so the parts can be written in any order
+    size_t len = st.st_size, parts = 0, cap = 64;
+    off_t *bounds = malloc(cap * sizeof(off_t));
+    int failed = bounds == NULL;
+    char *data = NULL;
+    if (!failed && mode != 'b' && len > 0)
+    {
+        // Only the line scan below reads the mapping; the parts are copied by offset
+        data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in, 0);
+        if (data == MAP_FAILED)
+        {
+            printf("-myShell: split: %s: %s\n", path ? path : "-", strerror(errno));
+            lastStatus = 1;
+            free(bounds);
+            if (path != NULL && strcmp(path, "-") != 0)
+                close(in);
+            return;
+        }
+        madvise(data, len, MADV_SEQUENTIAL);
+    }
+    if (!failed)
+        bounds[0] = 0;
+    for (size_t offset = 0; !failed && (mode == 'n' ? parts < size : offset < len);)
+    {
+        size_t end;
+        if (mode == 'b')
+            end = len - offset > size ? offset + size : len;
+        else if (mode == 'n')
+        {
+            // Part k ends at the first line end after k/N of the file
+            end = len * (parts + 1) / size;
+            if (parts + 1 == size)
+                end = len;
+            else if (end <= offset)
+                end = offset; // Lines longer than a part leave it empty
+            else
+            {
+                const char *newline = memchr(data + end - 1, '\n', len - end + 1);
+                end = newline ? (size_t)(newline - data) + 1 : len;
+            }
+        }
+        else
+        {
+            end = offset;
+            for (uint64_t lines = 0; lines < size && end < len; lines++)
+            {
+                const char *newline = memchr(data + end, '\n', len - end);
+                end = newline ? (size_t)(newline - data) + 1 : len;
+            }
+        }
+        if (parts + 2 > cap)
+        {
+            off_t *grown = realloc(bounds, cap * 2 * sizeof(off_t));
+            if (grown == NULL)
+            {
+                failed = 1;
+                break;
+            }
+            bounds = grown;
+            cap *= 2;
+        }
+        bounds[++parts] = end;
+        offset = end;
+    }
+    if (data != NULL)
+        unmapInput(data, len, 1);
+    if (failed)
+    {
+        printf("-myShell: split: %s\n", strerror(ENOMEM));
+        lastStatus = 1;
+        free(bounds);
+        if (path != NULL && strcmp(path, "-") != 0)
+            close(in);
+        return;
+    }
+
+    int width = 2;
+    for (size_t limit = 26 * 26; parts > limit && width < 12; limit *= 26)
+        width++;
+    if (threads < 1)
+        threads = onlineCpus();
+    if ((size_t)threads > parts)
+        threads = parts > 0 ? parts : 1;
+
+    SplitQueue queue = {in, bounds, parts, prefix, width, 0, 0};
+    pthread_t ids[threads];
+    int started = 0;
+    for (; started < threads - 1; started++)
+        if (pthread_create(&ids[started], NULL, splitWorker, &queue) != 0)
+            break;
+    splitWorker(&queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    lastStatus = queue.failed;
+    free(bounds);
+    if (path != NULL && strcmp(path, "-") != 0)
+        close(in);
+}
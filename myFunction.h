@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -9,8 +12,128 @@
 #include <limits.h>
 #include <libgen.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <termios.h>
+#include <dirent.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/sysmacros.h>
+#include <malloc.h>
 
 #define SIZE_BUFF 1024
+#define OUT_BUFF 65536 // Size of the shell output buffer
+
+typedef void (*BuiltinFunc)(char **args);
+
+typedef struct
+{
+    const char *name;
+    BuiltinFunc func;
+} Builtin;
+
+// Where and how a command or pipeline stage runs, from "pin" or @cpu=/@nice=/@batch words
+typedef struct
+{
+    int hasCpus;
+    cpu_set_t cpus;
+    int hasNice;
+    int nice;
+    int batch; // Run under SCHED_BATCH
+} StagePlacement;
+
+// One directory entry handed to a WalkVisit callback by walkTree
+typedef struct
+{
+    const char *path;   // Full path, only valid during the callback
+    size_t pathLen;
+    const char *name;   // Last component of 'path'
+    unsigned char type; // DT_* from getdents64, or from statx when that was unknown
+    struct statx *stat; // The requested statx fields, NULL when none were requested
+    int dirFd;          // Descriptor of the containing directory, for *at() calls
+    int depth;          // 0 for the root
+    uintptr_t tag;      // Inherited from the parent; a callback may set it for the children
+    int prune;          // Set by the callback to skip a directory's contents
+} WalkEntry;
+
+typedef void (*WalkVisit)(WalkEntry *entry, int worker, void *arg);
+
+// Counters for statsAdd
+enum
+{
+    STAT_COMMANDS_BUILTIN,
+    STAT_COMMANDS_EXTERNAL,
+    STAT_PIPELINES,
+    STAT_PIPELINE_STAGES,
+    STAT_FORKS, // External processes started
+    STAT_BYTES_CP,
+    STAT_BYTES_RD,
+    STAT_BYTES_MOVE,
+    STAT_COUNTERS
+};
+
+// Latency histograms for statsRecord
+enum
+{
+    STAT_FORK_EXEC, // fork() until the child has exec'd
+    STAT_LINE,      // One input line, start to finish
+    STAT_HISTOGRAMS
+};
+
+// Streams the builtins read from and write to. They are per thread so that a builtin
+// running as a pipeline stage can be pointed at a pipe while the others keep the terminal.
+extern __thread FILE *shellIn;
+extern __thread FILE *shellOut;
+
+extern int lastStatus; // Exit status of the last command, 0 for success
+extern int inputEnded; // Set once getInputFromUser has reached the end of its input
+
+void initOutput();
+/**
+ * Sets up the shell output buffer.
+ *
+ * Standard output is made fully buffered with an OUT_BUFF sized buffer, whether or not
+ * it is a terminal, so that builtins producing many small pieces of output do not issue
+ * one write per piece. Output reaches the terminal at the explicit flush points instead:
+ * before each prompt and before the shell forks.
+ */
+
+void flushOutput();
+/**
+ * Writes out everything pending in the shell output buffer and in 'shellOut'.
+ *
+ * Must be called before printing the prompt and before fork, so that the prompt is
+ * visible and a child process does not inherit (and later duplicate) pending output.
+ */
+
+void writeOutputv(const struct iovec *iov, int count);
+/**
+ * Writes a gathered list of buffers to 'shellOut'.
+ *
+ * Small totals are copied into the stdio buffer. Totals of at least a quarter of OUT_BUFF
+ * flush the buffer and are written with writev, retrying after partial writes, so large
+ * outputs cost one system call instead of one per piece.
+ *
+ * @param iov   The buffers to write, in order.
+ * @param count The number of entries in 'iov'.
+ *
+ * @error A failed write (for instance EPIPE once the reading pipeline stage exits) drops
+ *        the remaining output silently.
+ */
+
+void writeOutput(const char *data, size_t len);
+/**
+ * Writes a single buffer to 'shellOut', see writeOutputv.
+ */
 
 void getLocation();
 /**
@@ -43,32 +166,22 @@ char *getInputFromUser();
 /**
  * Reads a line of text from the user input until a newline character is encountered.
  *
- * This function dynamically allocates memory to store the characters read from the standard input,
- * including spaces but excluding the newline character. It automatically resizes the memory allocation
- * as more characters are read. The input is terminated when the newline character ('\n') is encountered,
- * which is not included in the returned string. The resulting string is null-terminated.
- *
- * The function starts with an initial allocation for one character and increases the allocation size by one
- * for each additional character read, including space for the null terminator at the end. This approach ensures
- * that the string is always properly null-terminated and that there is exactly enough memory allocated for the
- * number of characters read plus the null terminator.
- *
- * @return A pointer to the dynamically allocated string containing the user input. The caller is responsible
- *         for freeing this memory using free() when it is no longer needed.
+ * On a terminal the line is read in raw mode and echoed by the shell itself, which lets
+ * Tab complete the word under the cursor (see completeLine). A second Tab lists the
+ * candidates when the completion is ambiguous. Backspace and Ctrl-U edit the line,
+ * Ctrl-C discards it and Ctrl-D on an empty line ends the session.
  *
- * @warning This function uses getchar() to read input, which may behave differently in different environments
- *          and with different input buffering configurations. It is designed for simple console input scenarios.
+ * Any other input is read with getchar() up to the newline, which is not included in
+ * the returned string.
  *
- * @note If an error occurs during memory allocation, the function returns NULL. The caller should check the
- *       return value before using the result to ensure that the operation was successful.
+ * @return A pointer to the dynamically allocated, null-terminated line. The caller is
+ *         responsible for freeing this memory using free(). At end of input the line
+ *         "exit" is returned and 'inputEnded' is set, so that a caller in the middle of a
+ *         construct can tell it from a typed "exit".
  *
  * @example char *userInput = getInputFromUser();
- *          if (userInput != NULL) {
- *              printf("You entered: %s\n", userInput);
- *              free(userInput);
- *          } else {
- *              printf("Memory allocation failed.\n");
- *          }
+ *          printf("You entered: %s\n", userInput);
+ *          free(userInput);
  */
 
 char **splitArgument(char *str);
@@ -80,7 +193,8 @@ char **splitArgument(char *str);
  * these tokens. The caller must ensure the release of this memory to avoid memory leaks.
  *
  * @param str A pointer to the string that is to be tokenized. This string is modified by the
- *           function as it replaces spaces with null terminators to isolate tokens.
+ *           function as it replaces spaces with null terminators to isolate tokens. Spaces
+ *           inside double quotes, $(...) or `...` do not split.
  *
  * @return A dynamically allocated array of string pointers (char**), where each pointer
  *         directs to a token within the original string. The array is terminated by a NULL pointer to
@@ -267,15 +381,29 @@ void mypipe(char **argv1, char **argv2);
  *
  * In the inner child process, which executes the first command ('argv1'), the standard
  * output (STDOUT_FILENO) is redirected to the write end of the pipe ('fildes[1]') using
- * 'dup()', and then the command is executed with 'execvp()'. The read end of the pipe
+ * 'dup2()', and then the command is executed with 'execvp()'. The read end of the pipe
  * ('fildes[0]') is closed in this process, as it does not need to read from the pipe.
  *
  * In the outer child process, which is responsible for executing the second command
  * ('argv2'), the standard input (STDIN_FILENO) is redirected to the read end of the pipe
- * ('fildes[0]') using 'dup()', and then the command is executed with 'execvp()'. The
+ * ('fildes[0]') using 'dup2()', and then the command is executed with 'execvp()'. The
  * write end of the pipe ('fildes[1]') is closed in this process, as it does not need to
  * write to the pipe.
  *
+ * When either command is a builtin it runs inside the shell instead, without fork. Its
+ * 'shellIn' or 'shellOut' stream is pointed at the matching end of the pipe, so a line
+ * such as "rd big.log | wc -l" starts no process at all: the producer runs on a thread
+ * and the consumer on the calling thread. Only the external side, if any, is forked.
+ *
+ * Each stage may start with placement words: @cpu=LIST sets its CPU affinity, @nice=N its
+ * niceness and @batch the SCHED_BATCH policy, as in "@cpu=0 rd big.log | @cpu=1 wc -l".
+ * They are applied in the child before exec, or to the thread running a builtin stage.
+ * After "set pipepin auto", stages without @cpu= are pinned to two CPUs sharing a cache.
+ *
+ * NAME=value words after the placement apply to their stage only, as in
+ * "FOO=bar env | grep FOO": an external stage receives them in its environment, and a
+ * builtin stage sees them exported while the pipeline runs.
+ *
  * @param argv1 An array of string pointers, representing the arguments for the first command.
  * @param argv2 An array of string pointers, representing the arguments for the second command.
  *
@@ -454,3 +582,556 @@ void wordCount(char **args);
  * @error Handling is minimal, with the function designed to exit without output if the file
  *        cannot be opened. Additional error handling and user feedback might be desirable.
  */
+
+void grep(char **args);
+/**
+ * A builtin 'grep' that prints the lines of its inputs matching a pattern.
+ *
+ * The function expects 'args' in the form: grep [-c] [-n] [-v] [-i] pattern [file...].
+ * Flags may be combined ("-in"). When no file is given the standard input is searched.
+ * Files are memory mapped and searched in parallel by a small pool of worker threads,
+ * one file at a time per thread; the results are printed in argument order. The
+ * standard input is searched in blocks as it arrives and its matches are printed
+ * block by block, so grep works as a pipeline consumer on endless input.
+ *
+ * A pattern without metacharacters is treated as a literal and located with memmem
+ * (a case-folding scan under -i), which skips straight to candidate lines instead of
+ * testing each line. Other patterns
+ * support '.', '*', '^', '$', bracket classes ("[a-z]", "[^0-9]") and '\' escapes, and
+ * are compiled into a bit-parallel automaton that scans each line once.
+ *
+ * @param args An array of string pointers holding the command, its flags, the pattern
+ *             and the optional list of files.
+ *
+ * @note -c prints only the number of selected lines, -n prefixes each line with its
+ *       line number, -v selects the non-matching lines and -i ignores case.
+ * @warning Regular expressions are limited to 63 atoms; literals have no limit.
+ * @error Handling prints a message for a missing pattern, an invalid pattern or a file
+ *        that cannot be read; the remaining files are still searched. As in grep, the
+ *        status is 0 when a line was selected, 1 when none was and 2 on errors.
+ */
+
+void sortFile(char **args);
+/**
+ * A builtin 'sort' that prints the lines of a file or of its pipe input in sorted order.
+ *
+ * The function expects 'args' in the form: sort [-n] [-r] [-u] [-k field] [-S size] [-T dir] [file].
+ * The input is memory mapped and every line is represented by a view into the mapping,
+ * so lines and keys are never copied. The views are sorted by several threads, one slice
+ * each, and the sorted slices are merged.
+ *
+ * When the input plus its line index exceeds the memory cap (-S, 256M by default, with
+ * K, M and G suffixes), it is cut into chunks of whole lines that fit the cap. Each chunk
+ * is sorted and spilled as a run to an unlinked temporary file under -T (or $TMPDIR, or
+ * /tmp), and the runs are then merged through a min-heap, one line from each run at a time.
+ *
+ * @param args An array of string pointers holding the command, its options and the optional
+ *             file; without a file the shell's standard input is sorted.
+ *
+ * @note -n compares the leading number of the key, -r reverses the order, -u prints only the
+ *       first of the lines with equal keys and -k starts the key at the given field (fields are
+ *       separated by blanks). Lines with equal keys are ordered by their whole content.
+ * @error Handling prints a message and sets the status to 1 if the file cannot be opened, memory
+ *        runs out, or a run cannot be created, written in full or read back; nothing is printed
+ *        from a merge that would be missing lines.
+ */
+
+int captureCommand(char **args, char **output, size_t *len);
+/**
+ * Runs a command and collects everything it writes to its standard output.
+ *
+ * A builtin runs in-process with 'shellOut' pointed at a growing memory buffer. Any other
+ * command is forked and its output read from a pipe in blocks of at least OUT_BUFF bytes.
+ *
+ * @param args   The command and its arguments, NULL terminated.
+ * @param output Receives a malloc'd buffer with the output (not NUL terminated), or NULL
+ *               on failure. The caller frees it.
+ * @param len    Receives the number of bytes in '*output'.
+ *
+ * @return The exit status of the command ('lastStatus' after a builtin), or -1 if it
+ *         could not be started. A builtin's error messages are printed, not captured.
+ */
+
+void memo(char **args);
+/**
+ * Runs a command through the shell's output cache.
+ *
+ * "memo <command>" looks the command up by the working directory and its command line,
+ * together with the device, inode, size and modification time of every argument naming a
+ * file; the same key names entries on disk. On a hit the stored
+ * output is printed without running the command; on a miss the command runs, its output is
+ * printed and, if it succeeded, remembered. Entries live in an LRU list limited by a byte
+ * budget and can also be mirrored into a directory so they survive the shell.
+ *
+ * Subcommands:
+ *   memo stats               prints hits, misses, hit rate and memory use
+ *   memo clear               drops every in-memory entry and resets the counters
+ *   memo budget <size>       sets the byte budget (64M by default, K/M/G suffixes)
+ *   memo disk <dir|off>      mirrors entries into 'dir', or stops doing so
+ *
+ * A usage error or a disk directory that cannot be used sets the status to 1.
+ *
+ * @param args An array of string pointers holding "memo" and then the command or subcommand.
+ *
+ * @note Only use memo for read-only commands: their output is assumed to depend on nothing
+ *       but the command line and the files it names.
+ * @warning A file changed twice within the timestamp granularity of its filesystem, keeping
+ *          its size, is not detected.
+ */
+
+void trueCommand(char **args);
+/**
+ * The 'true' builtin: does nothing and succeeds, for use as a loop or if condition.
+ */
+
+void falseCommand(char **args);
+/**
+ * The 'false' builtin: does nothing and sets 'lastStatus' to 1.
+ */
+
+void runLine(char *input);
+/**
+ * Parses an input line into a syntax tree and executes it.
+ *
+ * The line is split into words with splitArgument; unquoted ';', '|', '&&' and '||' are
+ * then broken out into tokens of their own. From these tokens the parser builds a tree of
+ * command sequences ('a ; b'), conditional lists ('a && b', 'a || b'), two-stage pipelines
+ * ('a | b') and the compound commands
+ *
+ *   for NAME in WORDS ; do LIST ; done
+ *   while LIST ; do LIST ; done
+ *   if LIST ; then LIST ; [elif LIST ; then LIST ;] [else LIST ;] fi
+ *
+ * A for list consisting of a single "{first..last}" range counts through the numbers
+ * without materialising them. When a construct is still open at the end of the line the
+ * user is prompted with "> " for more lines, which are joined as if separated by ';' (or
+ * by a space after a trailing operator). Reaching the end of input while a construct is
+ * open is a syntax error.
+ *
+ * The tree is built once and then executed, so a loop body is parsed a single time no
+ * matter how often it runs. Each simple command has its words expanded ($NAME, ${NAME} and
+ * $?) into a scratch arena released after the command, and is then dispatched to a builtin,
+ * to mypipe, or forked and executed as an external command. The status of every command is
+ * kept in 'lastStatus' and drives '&&', '||', while and if.
+ *
+ * Command substitution, $(LINE) or `LINE`, is replaced by the output of LINE with trailing
+ * newlines removed; unquoted, that output is split into words at blanks, while inside
+ * double quotes or in the value of an assignment it stays one word. A lone simple command
+ * is captured directly (a builtin in-process, an external with one fork and exec), so
+ * nested substitutions of such commands fork nothing extra. Lists, assignments and
+ * builtins that change the shell (cd, export, unset, set, pin, exit) run in a forked
+ * subshell whose effects end with the substitution.
+ *
+ * Double quotes inside a word are removed, as in pre"a b"post, and keep the operators and
+ * spaces between them as part of the word.
+ *
+ * Words of the form NAME=value at the start of a command set shell variables when nothing
+ * follows them. Before a command they apply to that command only: an external command
+ * receives them in its environment, a builtin sees them exported while it runs.
+ *
+ * @param input The line typed by the user; it is not modified.
+ *
+ * @note The variable of a for loop is an ordinary shell variable, assigned before each
+ *       pass; it keeps its last value after the loop. Reserved words and operators inside
+ *       double quotes are taken literally.
+ * @error A syntax error prints the offending token and nothing on the line is executed.
+ *        A pipeline of more than two stages is rejected as a syntax error.
+ */
+
+void initVariables();
+/**
+ * Loads the process environment into the shell variable table, every entry exported.
+ *
+ * Shell variables live in a hash table keyed by name. Each variable keeps its
+ * "NAME=value" string ready to be passed to exec, so building the environment of a new
+ * process only collects pointers.
+ */
+
+const char *getVariable(const char *name);
+/**
+ * Returns the value of shell variable 'name', or NULL if it is not set.
+ */
+
+int setVariable(const char *name, const char *value, int exported);
+/**
+ * Sets shell variable 'name' to a copy of 'value'.
+ *
+ * @param exported 1 to export the variable, 0 to keep it local to the shell, -1 to keep
+ *                 its current state (new variables are then local).
+ *
+ * @return 0 on success, -1 if memory runs out.
+ */
+
+void unsetVariable(const char *name);
+/**
+ * Removes shell variable 'name', if set.
+ */
+
+int isExported(const char *name);
+/**
+ * Returns 1 if shell variable 'name' is set and exported, 0 otherwise.
+ */
+
+int isAssignment(const char *word);
+/**
+ * Returns 1 if 'word' has the form NAME=value, where NAME is a valid variable name.
+ */
+
+void assignVariable(const char *assignment, int exported);
+/**
+ * Applies a NAME=value word. The variable is exported if 'exported' is non-zero,
+ * otherwise it keeps its current export state.
+ */
+
+char **shellEnviron();
+/**
+ * Returns the environment for a new process: the "NAME=value" strings of every exported
+ * variable, NULL terminated.
+ *
+ * The array is built lazily and reused for every launch until an exported variable is
+ * set, exported, unexported or unset, so launching commands does not rebuild it each
+ * time. It must be obtained before fork, since the child must not allocate. Commands are
+ * looked up on the PATH of this environment, or the shell's PATH variable, not on the
+ * PATH the shell itself was started with.
+ *
+ * @warning The array and its strings belong to the variable table; they stay valid only
+ *          until the next variable change.
+ */
+
+void exportCommand(char **args);
+/**
+ * The 'export' builtin: "export NAME=value" sets and exports a variable, "export NAME"
+ * exports an existing one (or an empty one), and "export" alone lists the environment.
+ */
+
+void unsetCommand(char **args);
+/**
+ * The 'unset' builtin: removes each named shell variable.
+ */
+
+int copyRange(int in, off_t inOffset, int out, off_t outOffset, size_t len);
+/**
+ * Copies 'len' bytes between two file descriptors at the given offsets.
+ *
+ * The copy is done with copy_file_range, which lets the kernel move (or reflink) the
+ * data without it passing through user space. When the filesystem does not support it
+ * the rest is copied with pread/pwrite through a buffer.
+ *
+ * @return 0 on success, -1 on a read or write error (errno is set).
+ */
+
+int copyFile(const char *source, const char *destination);
+/**
+ * Copies a whole file with copyRange, creating or truncating 'destination'. A source that
+ * is not a regular file, or reports a size of 0 as /proc files do, is read to its end.
+ *
+ * @return 0 on success, -1 if a file cannot be opened or the copy fails (errno is set).
+ */
+
+void readFiles(char **paths, int countMode);
+/**
+ * Reads many files at once and prints their contents, or their line or word counts.
+ *
+ * This is the multi-file path of rd and wc. The files are taken in windows of a few
+ * hundred. Their opens and reads are submitted in batches through io_uring, with up to
+ * 64 files in flight, so that the latency of each operation is hidden behind the others.
+ * When io_uring is not available (or the variable MYSHELL_IO is "threads") a thread pool
+ * performs the same steps with blocking calls; so does a kernel whose io_uring cannot open,
+ * read and write (before 5.6). Files larger than 8 MiB, files past the 64 MiB a window may
+ * hold, and files without a size (pipes, /proc) are handled one at a time afterwards.
+ * tests/bench_io.sh ("make bench") times both paths on 10k small files.
+ *
+ * @param paths     NULL terminated list of files, printed in this order.
+ * @param countMode 0 to print the contents, 'l' or 'w' to print "<count> <path>" lines.
+ *
+ * @error A file that cannot be read prints a message naming it; the others are still printed.
+ */
+
+void copyIntoDirectory(char **args);
+/**
+ * The multi-file form of cp: "cp source... directory".
+ *
+ * Every source is copied to a file of the same base name inside 'directory'. The opens,
+ * reads and writes are batched through io_uring (or the thread pool fallback), as in
+ * readFiles. Files larger than 8 MiB are copied one at a time with copyFile.
+ *
+ * @param args The cp argument list; the last entry must name an existing directory.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+/**
+ * Computes the CRC-32C (Castagnoli) of a buffer, continuing from a previous 'crc'
+ * (0 to start). Uses the SSE4.2 crc32 instruction when the CPU has it and a
+ * slicing-by-8 table otherwise.
+ */
+
+uint64_t xxh64(const void *input, size_t len, uint64_t seed);
+/**
+ * Computes the 64-bit xxHash (XXH64) of a buffer.
+ */
+
+void sha256(const void *input, size_t len, unsigned char digest[32]);
+/**
+ * Computes the SHA-256 digest of a buffer, using the SHA-NI instructions when the CPU
+ * has them and a portable implementation otherwise.
+ */
+
+void sum(char **args);
+/**
+ * A builtin checksum command: sum [-a crc32c|xxh64|sha256] [file...].
+ *
+ * Prints "<hex digest>  <file>" for each file, in the format of sha256sum. SHA-256 is the
+ * default. The files are memory mapped and hashed in parallel, one file per worker thread.
+ * Without files the shell's standard input is hashed and printed as "-".
+ *
+ * @param args An array of string pointers holding the command, the optional algorithm and
+ *             the files.
+ *
+ * @error A file that cannot be opened prints a message and sets 'lastStatus' to 1.
+ */
+
+int copyVerified(const char *source, const char *destination, uint32_t *checksum);
+/**
+ * Copies a file for "cp --verify source destination".
+ *
+ * The CRC-32C of the data is computed while it is copied, in a single pass over the source
+ * with no read-back of the destination, which would only see the page cache. The copy is
+ * fsync'd, so errors the disk reports on write-back fail it. The checksum can then be
+ * compared with "sum -a crc32c" wherever the file ends up.
+ *
+ * @param checksum Receives the CRC-32C of the copied data.
+ *
+ * @return 0 if the copy was written and synced, -1 otherwise with errno set.
+ */
+
+int parseCpuList(const char *list, cpu_set_t *set);
+/**
+ * Parses a CPU list such as "0-3,6" into 'set'.
+ *
+ * @return 0 on success, -1 if the list is malformed or empty.
+ */
+
+void pin(char **args);
+/**
+ * The 'pin' prefix: pin [cpu-list] [-n nice] [-b] command [args...].
+ *
+ * Runs 'command' restricted to the CPUs of 'cpu-list', at niceness 'nice' and, with -b,
+ * under the SCHED_BATCH policy. External commands get these settings in the child before
+ * exec. Builtins run on a thread of their own with the settings applied to that thread,
+ * so the shell itself is left as it was.
+ *
+ * @note The same settings are available as @cpu=LIST, @nice=N and @batch words in front
+ *       of any command or pipeline stage.
+ * @warning Lowering the niceness below its current value requires privileges.
+ * @error As with taskset, a placement that cannot be parsed or applied (a CPU that does not
+ *        exist, a niceness that is not allowed) prints the error and sets the status to 1;
+ *        the command is not run.
+ */
+
+void setCommand(char **args);
+/**
+ * The 'set' builtin for shell settings. "set" alone lists them.
+ *
+ *   set pipepin auto|off   pin the two stages of each pipeline to different CPUs that
+ *                          share an L2 or L3 cache, read from /sys/devices/system/cpu
+ *   set pipesize SIZE      give every pipeline pipe SIZE bytes of capacity (K, M and G
+ *                          suffixes) with F_SETPIPE_SZ; "default" restores 64K
+ *
+ * @warning Sizes above /proc/sys/fs/pipe-max-size need CAP_SYS_RESOURCE; the pipe then
+ *          keeps its default capacity.
+ */
+
+void teeCommand(char **args);
+/**
+ * The 'tee' builtin: tee [-a] [file...]. Copies its input to its output and to every
+ * file, appending with -a.
+ *
+ * When the input is a pipeline pipe the data never enters user space: splice(2) moves
+ * it into the first file, copy_file_range(2) copies it on to the others, and stdout gets
+ * tee(2) when it is a pipe or sendfile(2) otherwise. Any other input is copied through a
+ * buffer.
+ *
+ * @error A file that cannot be opened is reported and skipped.
+ */
+
+int completeLine(const char *line, size_t len, char *extension, size_t size, FILE *listing);
+/**
+ * Completes the last word of line[0..len).
+ *
+ * A word opening the line or following '|', ';' or '&' completes against builtin names
+ * and the executables on PATH. Any other word, or one containing '/', completes against
+ * the entries of its directory (the current one by default). Each directory is kept as
+ * a prefix trie that is rebuilt only when the directory's mtime changes.
+ *
+ * @param extension Receives the text to append: the longest continuation shared by
+ *                  all matches, plus '/' or ' ' when the match is unique.
+ * @param listing   When not NULL and several words match, they are printed to it.
+ * @return 0 with no match, 1 for a unique match, 2 when ambiguous.
+ */
+
+void addHistory(const char *line, int status, long milliseconds);
+/**
+ * Appends a command line to the history file with the time, its exit status, how long
+ * it ran and the current directory.
+ *
+ * The file is $HISTFILE, or ~/.myshell_history by default. Each record is one line
+ * written by a single write() on an O_APPEND descriptor, so several shells can share
+ * the file safely.
+ *
+ * @note Blank lines are skipped, and so is non-interactive input unless HISTFILE is set.
+ */
+
+void historyCommand(char **args);
+/**
+ * The 'history' builtin.
+ *
+ *   history [N]                   show all records, or the last N
+ *   history search [-n N] text    show the records whose command contains 'text', or
+ *                                 the last N of them
+ *
+ * The file is mapped rather than read. Searches use an in-memory trigram index of the
+ * commands. The index is built on the first search and later extended with only the
+ * records added since, including those from other shells.
+ */
+
+int walkThreads(int requested);
+/**
+ * Number of workers for a walk: 'requested' when positive, otherwise the number of
+ * online CPUs but at least four, since directory reads mostly wait on the disk.
+ */
+
+int walkTree(const char *command, const char *root, unsigned int mask, int threads, WalkVisit visit, void *arg);
+/**
+ * Walks the tree under 'root' in parallel and calls 'visit' once for every entry,
+ * the root included.
+ *
+ * Directories are read with getdents64 on 'threads' workers that steal directories from
+ * each other's queues. Entries are only passed to statx, relative to their directory,
+ * when 'mask' asks for fields or getdents64 could not tell the type. Symbolic links are
+ * never followed.
+ *
+ * @param command Name used in error messages, such as "find".
+ * @param visit   Called concurrently from all workers; 'worker' (0 to threads - 1)
+ *                lets it keep per-worker state without locking.
+ * @return 0, or -1 if 'root' cannot be examined. Unreadable directories below it are
+ *         reported and skipped.
+ */
+
+void findCommand(char **args);
+/**
+ * The 'find' builtin.
+ *
+ *   find [-j N] [path...] [-name PATTERN] [-type f|d|l] [-size [+-]N[cKMG]] [-mtime [+-]DAYS]
+ *   find --index FILE [-j N] [path...]
+ *   find --lookup FILE [prefix] [-name PATTERN] [-type f|d|l]
+ *
+ * The first form walks each path (default ".") with walkTree and prints the entries
+ * that pass every test. "+N" means more than N, "-N" less than N and "N" exactly N.
+ * Sizes are counted in bytes, or in units of the suffix rounded up. Output order is
+ * not defined, because the walk is parallel.
+ *
+ * --index writes the absolute paths under the given trees to FILE, sorted and front
+ * coded in blocks. --lookup maps FILE, binary searches for the paths starting with
+ * 'prefix' and filters them by name and type without touching the tree.
+ *
+ * @note The index only stores names and types, so lookups cannot test size or mtime.
+ */
+
+void du(char **args);
+/**
+ * The 'du' builtin: du [-n N] [-j threads] [path].
+ *
+ * Sums the allocated blocks under 'path' (default ".") with walkTree and prints the N
+ * largest entries directly inside it (default 10), largest first, then the total.
+ * A file with several hard links is counted once, at the first link reached; the
+ * inodes already seen are kept in a sharded hash set keyed by device and inode.
+ *
+ * @note Sizes are allocated space, as in coreutils du, not apparent file sizes.
+ */
+
+void statsAdd(int counter, uint64_t n);
+/**
+ * Adds 'n' to one of the STAT_* counters.
+ *
+ * Each thread counts into a block of its own, so the cost is a thread-local load and
+ * store with no lock and no atomic read-modify-write. Blocks of exited threads are
+ * folded into a shared total.
+ */
+
+void statsRecord(int histogram, uint64_t microseconds);
+/**
+ * Adds a sample to one of the STAT_* latency histograms, in log2 microsecond buckets.
+ */
+
+void stats(char **args);
+/**
+ * The 'stats' builtin.
+ *
+ *   stats                      summary of the counters, latencies and heap
+ *   stats prom                 the same in the Prometheus text format
+ *   stats dump FILE [SECONDS]  rewrite FILE in the Prometheus format every SECONDS
+ *                              (default 15) from a background thread
+ *   stats dump off             stop the periodic dump
+ *
+ * The fork+exec histogram has one sample per fork that runs a program: a simple command,
+ * a captured command, or a pipeline (whose sample ends once every external stage has
+ * exec'd). Subshells fork without exec'ing, so they count as processes only.
+ *
+ * Allocation counts are not kept: counting every malloc would mean wrapping the
+ * allocator. The heap gauges from mallinfo2() (bytes in use, free and mmapped, and the
+ * number of mmapped blocks) stand in for them.
+ */
+
+void cmp(char **args);
+/**
+ * The 'cmp' builtin: cmp [-s] file1 file2, where "-" is the shell's input.
+ *
+ * Maps both files and prints the first byte and line where they differ, or which one
+ * ends first. With -s nothing is printed and files of different sizes are rejected
+ * from stat() alone. The comparison runs 64 bytes per step with AVX2 when the CPU has
+ * it and 32 with SSE2 otherwise. Files of 64 MiB and more are split into 16 MiB chunks
+ * compared on all CPUs, keeping the lowest difference found.
+ *
+ * Sets the status to 0 for identical files, 1 when they differ and 2 on errors.
+ */
+
+void count(char **args);
+/**
+ * The 'count' builtin: count [-k field] [-d delim] [-n N] [-j threads] [file]
+ *
+ * Does the work of "sort | uniq -c | sort -rn | head" in one pass. Each line, or its
+ * field-th field, is counted in an open addressing hash table whose keys are copied once
+ * into an arena, and the N most frequent keys are printed as "count key", ties in key
+ * order. Fields are separated by runs of blanks, or by the single character 'delim'.
+ *
+ * Files are mapped; standard input is read in large blocks. With -j each thread counts a
+ * line-aligned slice into a table of its own, and the tables are merged at the end (0
+ * uses every CPU). Only N entries are ever sorted: a heap of that size keeps the top keys
+ * while the table is scanned. N defaults to 10; 0 prints every key.
+ *
+ * @error A file that cannot be read, or memory running out, prints the reason and sets
+ *        the status to 1; counts that ran out of memory are not printed.
+ */
+
+void split(char **args);
+/**
+ * The 'split' builtin: split [-b SIZE | -l LINES | -n PARTS] [-j threads] [file] [prefix]
+ *
+ * Cuts a file into parts named prefix + "aa", "ab", ... ("x" by default, with more
+ * letters when there are over 676 parts): every SIZE bytes (suffixes K, M, G), every
+ * LINES lines (1000 by default) or into PARTS line-aligned parts of about equal size.
+ *
+ * The part boundaries of a regular file are found first, with memchr over a mapping of
+ * the file; -b needs no look at the data at all. The parts are then written by up to
+ * 'threads' threads (all CPUs by default) with copyRange, the zero-copy path of cp. A
+ * pipe on standard input is cut while it is read instead, and cannot be used with -n.
+ */
+
+BuiltinFunc findBuiltin(const char *name);
+/**
+ * Looks up a builtin command by name in the shell's builtin table.
+ *
+ * @param name The command name, usually the first token of the input line. May be NULL.
+ *
+ * @return The function implementing the builtin, or NULL if 'name' is not a builtin.
+ */
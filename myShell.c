@@ -3,6 +3,12 @@
 
 int main()
 {
+    shellIn = stdin;
+    shellOut = stdout;
+    signal(SIGPIPE, SIG_IGN); // Builtin pipeline stages get EPIPE instead of killing the shell
+    initOutput();
+    initVariables();
+
     welcome();
     while (1)
     {
@@ -11,58 +17,13 @@ int main()
         if (strcmp(input, "exit") == 0 || strncmp(input, "exit ", 5) == 0)
             logout(input);
 
-        if (strchr(input, '|') != NULL)
-        {
-            // If input contains '|', we assume it's a pipe command
-            char **argv1, **argv2;
-            splitInputForPipe(input, &argv1, &argv2);
-
-            // Execute the piped commands
-            mypipe(argv1, argv2);
-
-            // Wait for all child processes to finish
-            int status;
-            while (wait(&status) > 0)
-                ;
-
-            // Free the memory allocated for the arguments
-            for (int i = 0; argv1[i] != NULL; i++)
-            {
-                free(argv1[i]);
-            }
-            for (int i = 0; argv2[i] != NULL; i++)
-            {
-                free(argv2[i]);
-            }
-            free(argv1);
-            free(argv2);
-        }
-        else
-        {
-            // Process other commands if no pipe is found
-            char **arguments = splitArgument(input);
-
-            if (strcmp(input, "echo") == 0)
-                echo(arguments);
-            else if (strcmp(input, "cd") == 0)
-                cd(arguments);
-            else if (strcmp(input, "cp") == 0)
-                cp(arguments);
-            else if (strcmp(input, "delete") == 0)
-                delete (arguments);
-            else if (strcmp(input, "move") == 0)
-                move(arguments);
-            else if (strcmp(input, "cat") == 0)
-                echoppend(arguments);
-            else if (strcmp(input, "wrt") == 0)
-                echowrite(arguments);
-            else if (strcmp(input, "rd") == 0)
-                rd(arguments);
-            else if (strcmp(input, "wc") == 0)
-                wordCount(arguments);
-
-            free(arguments);
-        }
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        runLine(input);
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        long micros = (finished.tv_sec - started.tv_sec) * 1000000 + (finished.tv_nsec - started.tv_nsec) / 1000;
+        statsRecord(STAT_LINE, micros);
+        addHistory(input, lastStatus, micros / 1000);
         free(input);
     }
     return 0;
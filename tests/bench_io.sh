@@ -0,0 +1,28 @@
+#!/bin/sh
+# Reads and copies 10k small files with the batched builtins, once through io_uring and
+# once through the thread pool (MYSHELL_IO=threads). Run from the repository: make bench
+SHELL_BIN=${SHELL_BIN:-./myShell}
+FILES=${FILES:-10000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir "$WORK/src"
+i=0
+while [ $i -lt "$FILES" ]; do
+    printf 'line one of %d\nline two\n' $i > "$WORK/src/f$i"
+    i=$((i + 1))
+done
+LIST=$(cd "$WORK/src" && ls | sed "s|^|$WORK/src/|" | tr '\n' ' ')
+
+for mode in uring threads; do
+    rm -rf "$WORK/dst"
+    mkdir "$WORK/dst"
+    setting=""
+    [ $mode = threads ] && setting="MYSHELL_IO=threads"
+    printf '%s\nwc -l %s\ncp %s %s\nexit\n' "$setting" "$LIST" "$LIST" "$WORK/dst" > "$WORK/script"
+    start=$(date +%s%N)
+    "$SHELL_BIN" < "$WORK/script" > /dev/null
+    end=$(date +%s%N)
+    copied=$(ls "$WORK/dst" | wc -l)
+    echo "$mode: wc -l and cp of $FILES files in $(((end - start) / 1000000)) ms, $copied copied"
+done
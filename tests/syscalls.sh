@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks that large builtin output goes out in few write calls: the output layer fills
+# OUT_BUFF (64 KiB) blocks and echo gathers its arguments into one writev. Counts the
+# write/writev calls of each command under strace, minus those of a shell that only exits
+# (banner and prompts). Run from the repository: make check
+SHELL_BIN=${SHELL_BIN:-./myShell}
+OUT_BUFF=65536
+if ! command -v strace > /dev/null; then
+    echo "syscalls: strace not found, skipped"
+    exit 77
+fi
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Number of write and writev calls made while running the commands in $1
+writes() {
+    printf '%s\nexit\n' "$1" > "$WORK/script"
+    strace -f -qq -e trace=write,writev -o "$WORK/trace" "$SHELL_BIN" < "$WORK/script" > /dev/null
+    grep -c -E '^([0-9]+ +)?writev?\(' "$WORK/trace"
+}
+
+failed=0
+check() {
+    name=$1 commands=$2 limit=$3
+    calls=$(($(writes "$commands") - base))
+    if [ "$calls" -le "$limit" ]; then
+        echo "ok   $name: $calls write calls (limit $limit)"
+    else
+        echo "FAIL $name: $calls write calls (limit $limit)"
+        failed=1
+    fi
+}
+
+base=$(writes "")
+
+# 32 MiB of short lines: one call per output block, not per line
+seq 1 4000000 | head -c 33554432 > "$WORK/big"
+check "rd of 32 MiB" "rd $WORK/big" $((33554432 / OUT_BUFF + 2))
+
+# 2000 arguments: a single writev rather than one write per argument
+args=$(seq 1 2000 | tr '\n' ' ')
+check "echo of 2000 words" "echo $args" 2
+
+# 20000 echo commands in a loop share the buffer until the next prompt
+check "loop of 20000 echos" "for i in {1..20000} ; do echo \$i ; done" $((20000 * 6 / OUT_BUFF + 2))
+
+exit $failed